@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#include "command_queue.h"
+#include "gearbox.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Command_Queue::Command_Queue(uint32_t capacity)
+: tail(0)
+, head(0)
+{
+    uint64_t size = 1;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    cells.reset(new Cell[size]);
+    mask = size - 1;
+    for (uint64_t i = 0; i < size; i++)
+    {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+bool Command_Queue::engage(Base_Gear* gear, bool engaged)
+{
+    Command command;
+    command.gear = gear;
+    command.ratio = 0;
+    command.step = 0;
+    command.operation = engaged ? Engage : Disengage;
+    return push(command);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+bool Command_Queue::retune(Base_Gear* gear, uint16_t ratio, uint16_t step)
+{
+    Command command;
+    command.gear = gear;
+    command.ratio = ratio;
+    command.step = step;
+    command.operation = Retune;
+    return push(command);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+bool Command_Queue::push(const Command& command)
+{
+    // claim the cell at the tail, unless it still holds a request from the last time around
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;)
+    {
+        cell = &cells[position & mask];
+        uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+        int64_t lag = (int64_t)(sequence - position);
+        if (lag == 0)
+        {
+            if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (lag < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->command = command;
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint32_t Command_Queue::drain()
+{
+    uint32_t applied = 0;
+    for (;;)
+    {
+        Cell& cell = cells[head & mask];
+        if (cell.sequence.load(std::memory_order_acquire) != head + 1)
+        {
+            break;
+        }
+
+        Command command = cell.command;
+        cell.sequence.store(head + mask + 1, std::memory_order_release);
+        head++;
+
+        switch (command.operation)
+        {
+        case Engage:
+            command.gear->engage(true);
+            break;
+        case Disengage:
+            command.gear->engage(false);
+            break;
+        case Retune:
+            command.gear->retune(command.ratio, command.step);
+            break;
+        }
+        applied++;
+    }
+    return applied;
+}
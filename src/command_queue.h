@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#ifndef _WELLWOOD_COMMAND_QUEUE_H_
+#define _WELLWOOD_COMMAND_QUEUE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+class Base_Gear;
+
+/*
+ * Command_Queue carries requests to engage, disengage or retune gears from any number of threads
+ * to the thread ticking them. Requests are queued without locks or waiting, into a ring of a fixed
+ * number of cells, and the ticking thread applies them with drain() before a tick, in the order
+ * they were queued. A Gearbox given a queue with Gearbox::set_commands() drains it at the start
+ * of each tick() and advance(); a tree of Base_Gears is drained by calling drain() before
+ * ticking its drive gear.
+ *
+ * The gears named in requests must outlive the requests.
+ */
+class Command_Queue
+{
+public:
+
+    /*
+     * Creates a queue that holds up to 'capacity' requests, rounded up to a power of two.
+     */
+    explicit Command_Queue(uint32_t capacity = 1024);
+
+    /*
+     * Requests that 'gear' be engaged or disengaged, as by Base_Gear::engage(). Returns false,
+     * without queuing the request, if the queue is full. May be called from any thread.
+     */
+    bool engage(Base_Gear* gear, bool engaged);
+
+    /*
+     * Requests that 'gear' be retuned, as by Base_Gear::retune(). Returns false, without queuing
+     * the request, if the queue is full. May be called from any thread.
+     */
+    bool retune(Base_Gear* gear, uint16_t ratio, uint16_t step = 1);
+
+    /*
+     * Applies the requests queued so far, and returns the number applied. Stops early at a request
+     * whose thread has not finished queuing it, which is applied by the next drain(). May only be
+     * called by the thread ticking the gears, and not from a handler.
+     */
+    uint32_t drain();
+
+private:
+
+    Command_Queue(const Command_Queue& other) = delete;
+    Command_Queue& operator=(const Command_Queue&) = delete;
+
+    enum Operation : uint8_t { Engage, Disengage, Retune };
+
+    struct Command
+    {
+        Base_Gear* gear;
+        uint16_t   ratio;
+        uint16_t   step;
+        Operation  operation;
+    };
+
+    /*
+     * Each cell's sequence number says whose turn it is: it equals the position a request will be
+     * queued at when the cell is free, and that position + 1 once the request has been written.
+     */
+    struct Cell
+    {
+        std::atomic<uint64_t> sequence;
+        Command               command;
+    };
+
+    bool push(const Command& command);
+
+    std::unique_ptr<Cell[]> cells;
+    uint64_t                mask;       // number of cells - 1
+
+    alignas(64) std::atomic<uint64_t> tail;     // position of the next request to be queued
+    alignas(64) uint64_t              head;     // position of the next request to be applied
+};
+
+#endif // _WELLWOOD_COMMAND_QUEUE_H_ //
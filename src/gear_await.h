@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#ifndef _WELLWOOD_GEAR_AWAIT_H_
+#define _WELLWOOD_GEAR_AWAIT_H_
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "gearbox.h"
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <initializer_list>
+
+/*
+ * Coroutines can wait for the ticks and rotations of an Awaitable_Gear, so a sequence of steps
+ * spread over time reads as one function rather than as a state machine of handlers:
+ *
+ *     Gear_Task blink(Awaitable_Gear& ms, Led& led)
+ *     {
+ *         for (;;)
+ *         {
+ *             led.on();
+ *             co_await ms.rotations(50);
+ *             led.off();
+ *             co_await ms.rotations(950);
+ *         }
+ *     }
+ *
+ * A coroutine waiting on a gear is resumed from the gear's handler, on the tick the gear fires
+ * the event it waits for, whether the gear is ticked by its drive gear or by a Gearbox, through
+ * tick() or advance(), and in the order the coroutines began waiting. The state of a wait is
+ * kept in the coroutine's frame, so waiting allocates nothing, and a gear nobody waits on handles
+ * no events, so it costs the tree no more than a counter.
+ *
+ * This header needs C++20 coroutines, and is empty without them.
+ */
+
+//-----------------------------------------------------------------------------------------------//
+
+/*
+ * The return type of a coroutine that runs as soon as it is called, until it first waits, and is
+ * resumed by what it waits on. Nothing holds on to it: its frame is freed when it returns, and
+ * it may not throw.
+ */
+class Gear_Task
+{
+public:
+
+    struct promise_type
+    {
+        Gear_Task get_return_object() { return Gear_Task(); }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() { }
+
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+//-----------------------------------------------------------------------------------------------//
+
+/*
+ * A gear whose ticks and rotations can be awaited by coroutines. Like a Gear<T>, it only fires
+ * its events while it is engaged, so a coroutine waiting on a disengaged gear waits until it is
+ * engaged again.
+ */
+class Awaitable_Gear : public Base_Gear
+{
+public:
+
+    /*
+     * The wait of a coroutine for events of a gear, made with co_await.
+     */
+    class Waiter
+    {
+    public:
+
+        bool await_ready() const { return remaining == 0; }
+
+        void await_suspend(std::coroutine_handle<> handle);
+
+        void await_resume() const { }
+
+    private:
+
+        friend class Awaitable_Gear;
+
+        Waiter(Awaitable_Gear* gear, uint8_t event, uint64_t remaining)
+        : gear(gear)
+        , next(nullptr)
+        , remaining(remaining)
+        , event(event)
+        { }
+
+        Waiter(const Waiter& other) = delete;
+        Waiter& operator=(const Waiter&) = delete;
+
+        Awaitable_Gear*         gear;
+        Waiter*                 next;       // next to wait on the same event of the gear
+        uint64_t                remaining;  // events to wait for
+        uint8_t                 event;      // Tick_Event or Rotation_Event
+        std::coroutine_handle<> handle;     // coroutine to resume
+    };
+
+    /*
+     * Use this constructor to instantiate a gear that will be driven by another.
+     */
+    Awaitable_Gear()
+    : Base_Gear(0, 1)
+    { set_handled_events(0); }
+
+    /*
+     * Creates a new main drive gear (not driven by another).
+     */
+    Awaitable_Gear(uint16_t phase, uint16_t step)
+    : Base_Gear(phase, step)
+    { set_handled_events(0); }
+
+    /*
+     * Destroys the coroutines still waiting on the gear.
+     */
+    ~Awaitable_Gear();
+
+    /*
+     * Returns a wait, for co_await, that resumes the coroutine on the 'count'th rotation of the
+     * gear from now, or at once if 'count' is 0. A coroutine resumed by a tick of the gear on which
+     * it also rotates, that waits for its rotations, counts that rotation.
+     */
+    Waiter rotations(uint64_t count = 1) { return Waiter(this, Rotation_Event, count); }
+
+    /*
+     * Returns a wait, for co_await, that resumes the coroutine on the gear's next tick. A gear
+     * parked by a scheduled Gearbox is taken out of the timing wheel by the next tick, so a wait
+     * that begins while a scheduled gearbox is ticking, on a gear it has yet to tick, resumes on
+     * the tick after.
+     */
+    Waiter next_tick() { return Waiter(this, Tick_Event, 1); }
+
+protected:
+
+    virtual void on_tick() override { wake(ticks, Tick_Event); }
+
+    virtual void on_rotation() override { wake(turns, Rotation_Event); }
+
+private:
+
+    struct Queue
+    {
+        Waiter* first = nullptr;
+        Waiter* last = nullptr;
+    };
+
+    /*
+     * Queues 'waiter' on the event it waits for, which the gear then handles, and which its
+     * Gearbox then observes (see Base_Gear::set_handled_events()).
+     */
+    void wait(Waiter* waiter);
+
+    /*
+     * Counts an 'event' for each waiter in 'queue', and resumes those it was the last for.
+     */
+    void wake(Queue& queue, uint8_t event);
+
+    static void append(Queue& queue, Waiter* waiter);
+
+    Queue ticks;                    // coroutines waiting for ticks, in the order they began
+    Queue turns;                    // coroutines waiting for rotations, in the order they began
+};
+
+//-----------------------------------------------------------------------------------------------//
+
+inline void Awaitable_Gear::Waiter::await_suspend(std::coroutine_handle<> handle)
+{
+    this->handle = handle;
+    gear->wait(this);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+inline Awaitable_Gear::~Awaitable_Gear()
+{
+    for (Queue* queue : { &ticks, &turns })
+    {
+        Waiter* waiter = queue->first;
+        while (waiter != nullptr)
+        {
+            // the waiter is in the frame destroyed along with its coroutine
+            Waiter* next = waiter->next;
+            waiter->handle.destroy();
+            waiter = next;
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+inline void Awaitable_Gear::wait(Waiter* waiter)
+{
+    append((waiter->event == Tick_Event) ? ticks : turns, waiter);
+    set_handled_events(get_handled_events() | waiter->event);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+inline void Awaitable_Gear::wake(Queue& queue, uint8_t event)
+{
+    // the queue is emptied before any coroutine is resumed, as one resumed can wait again, on
+    // this gear or another, and a waiter is read before its coroutine is resumed, as it is gone
+    // once the coroutine's co_await completes
+    Waiter* waiter = queue.first;
+    queue = Queue();
+    Queue ready;
+    while (waiter != nullptr)
+    {
+        Waiter* next = waiter->next;
+        append((--waiter->remaining == 0) ? ready : queue, waiter);
+        waiter = next;
+    }
+    if (queue.first == nullptr)
+    {
+        set_handled_events(get_handled_events() & ~event);
+    }
+
+    waiter = ready.first;
+    while (waiter != nullptr)
+    {
+        Waiter* next = waiter->next;
+        waiter->handle.resume();
+        waiter = next;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+inline void Awaitable_Gear::append(Queue& queue, Waiter* waiter)
+{
+    waiter->next = nullptr;
+    if (queue.last != nullptr)
+    {
+        queue.last->next = waiter;
+    }
+    else
+    {
+        queue.first = waiter;
+    }
+    queue.last = waiter;
+}
+
+#endif // __cpp_impl_coroutine //
+
+#endif // _WELLWOOD_GEAR_AWAIT_H_ //
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#ifndef _WELLWOOD_GEAR_TRAIN_H_
+#define _WELLWOOD_GEAR_TRAIN_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/*
+ * A gear train is a gear tree that is fixed at compile time. Its shape, ratios, steps, starting
+ * phases and handlers are declared in its type, and it ticks the same way and in the same order
+ * as a tree of Base_Gears, but without virtual calls, member function pointers or linked lists:
+ * every gear's tick is a template instance that the compiler can inline into its drive gear's.
+ *
+ * A train is declared as its drive gear, followed by the gears it drives, in tick order:
+ *
+ *     typedef Train<
+ *         Child<Ratio<1>, Count_Rotations,                         // tick_counter
+ *             Child<Ratio<1000>, Step<80>, Count_Rotations,        // ms_counter
+ *                 Child<Ratio<1000>, On_Rotation<&User_Class::increment>>>>> Clock;
+ *
+ * Each gear, the drive gear included, takes any of:
+ *
+ *     Ratio<N>            ratio of the gear to its drive gear (default 1)
+ *     Step<N>             phase increment per tick (default 1)
+ *     Phase<N>            starting phase (default 0)
+ *     Count_Rotations     counts rotations while engaged, like a Counter
+ *     On_Engaged<&T::f>   handlers, like those of Gear<T>. All of a gear's handlers must be
+ *     On_Disengaged<&T::f>    members of the same class T, and its observer must be set with
+ *     On_Tick<&T::f>          observe() before the first tick.
+ *     On_Rotation<&T::f>
+ *     Child<...>          a gear driven by this one
+ */
+
+template <uint16_t N> struct Ratio { static const uint16_t value = N; };
+template <uint16_t N> struct Step  { static const uint16_t value = N; };
+template <uint16_t N> struct Phase { static const uint16_t value = N; };
+
+template <auto F> struct On_Engaged    { static constexpr auto handler = F; };
+template <auto F> struct On_Disengaged { static constexpr auto handler = F; };
+template <auto F> struct On_Tick       { static constexpr auto handler = F; };
+template <auto F> struct On_Rotation   { static constexpr auto handler = F; };
+
+struct Count_Rotations { };
+
+template <class... Specs> struct Child { };
+
+template <class... Specs> class Train_Gear;
+
+//-----------------------------------------------------------------------------------------------//
+
+namespace gear_train
+{
+    /*
+     * The value of the first spec of template 'Kind' in 'Specs', or 'Default'.
+     */
+    template <template <uint16_t> class Kind, uint16_t Default, class... Specs>
+    struct Find_Value { static const uint16_t value = Default; };
+
+    template <template <uint16_t> class Kind, uint16_t Default, uint16_t N, class... Specs>
+    struct Find_Value<Kind, Default, Kind<N>, Specs...> { static const uint16_t value = N; };
+
+    template <template <uint16_t> class Kind, uint16_t Default, class Spec, class... Specs>
+    struct Find_Value<Kind, Default, Spec, Specs...> : Find_Value<Kind, Default, Specs...> { };
+
+    /*
+     * The handler of the first spec of template 'Kind' in 'Specs', and the class it is a member
+     * of, or void if there is none.
+     */
+    template <template <auto> class Kind, class... Specs>
+    struct Find_Handler
+    {
+        static const bool found = false;
+        typedef void observer_type;
+    };
+
+    template <class F> struct Member_Of;
+    template <class T> struct Member_Of<void (T::*)()> { typedef T type; };
+
+    template <template <auto> class Kind, auto F, class... Specs>
+    struct Find_Handler<Kind, Kind<F>, Specs...>
+    {
+        static const bool found = true;
+        static constexpr auto handler = F;
+        typedef typename Member_Of<decltype(F)>::type observer_type;
+    };
+
+    template <template <auto> class Kind, class Spec, class... Specs>
+    struct Find_Handler<Kind, Spec, Specs...> : Find_Handler<Kind, Specs...> { };
+
+    /*
+     * True if 'Spec' is one of 'Specs'.
+     */
+    template <class Spec, class... Specs>
+    struct Has_Spec { static const bool value = (std::is_same<Spec, Specs>::value || ...); };
+
+    /*
+     * The class observing a gear: that of its first handler, or void if it has none.
+     */
+    template <class... Specs>
+    struct Observer_Of
+    {
+        typedef typename Find_Handler<On_Engaged, Specs...>::observer_type engaged;
+        typedef typename Find_Handler<On_Disengaged, Specs...>::observer_type disengaged;
+        typedef typename Find_Handler<On_Tick, Specs...>::observer_type tick;
+        typedef typename Find_Handler<On_Rotation, Specs...>::observer_type rotation;
+
+        typedef typename std::conditional<!std::is_void<engaged>::value, engaged,
+                typename std::conditional<!std::is_void<disengaged>::value, disengaged,
+                typename std::conditional<!std::is_void<tick>::value, tick, rotation
+                >::type>::type>::type type;
+
+        static const bool consistent =
+            (std::is_void<engaged>::value    || std::is_same<engaged, type>::value) &&
+            (std::is_void<disengaged>::value || std::is_same<disengaged, type>::value) &&
+            (std::is_void<tick>::value       || std::is_same<tick, type>::value) &&
+            (std::is_void<rotation>::value   || std::is_same<rotation, type>::value);
+    };
+
+    /*
+     * The gears driven by a gear, as a tuple of Train_Gears built from the Child specs.
+     */
+    template <class Spec> struct Wrap_Child { typedef std::tuple<> type; };
+    template <class... Specs>
+    struct Wrap_Child<Child<Specs...>> { typedef std::tuple<Train_Gear<Specs...>> type; };
+
+    template <class... Specs>
+    struct Children_Of
+    {
+        typedef decltype(std::tuple_cat(std::declval<typename Wrap_Child<Specs>::type>()...)) type;
+    };
+
+    /*
+     * Optional parts of a gear, empty when unused so they take no space.
+     */
+    template <class T> struct Observer_Part { T* observer = nullptr; };
+    template <> struct Observer_Part<void> { };
+
+    template <bool Counted> struct Count_Part { uint64_t total = 0; };
+    template <> struct Count_Part<false> { };
+}
+
+//-----------------------------------------------------------------------------------------------//
+
+/*
+ * A gear of a train, and through its children, the gears it drives. Train_Gear is not declared
+ * directly; it is instantiated for a train and each of its Child specs.
+ */
+template <class... Specs>
+class Train_Gear
+: private gear_train::Observer_Part<typename gear_train::Observer_Of<Specs...>::type>
+, private gear_train::Count_Part<gear_train::Has_Spec<Count_Rotations, Specs...>::value>
+{
+public:
+
+    static const uint16_t ratio = gear_train::Find_Value<Ratio, 1, Specs...>::value;
+    static const uint16_t step = gear_train::Find_Value<Step, 1, Specs...>::value;
+    static const uint16_t start_phase = gear_train::Find_Value<Phase, 0, Specs...>::value;
+    static const bool counted = gear_train::Has_Spec<Count_Rotations, Specs...>::value;
+
+    typedef typename gear_train::Observer_Of<Specs...>::type observer_type;
+    typedef typename gear_train::Children_Of<Specs...>::type children_type;
+
+    static_assert(step >= 1 && step <= ratio, "a gear's step must be from 1 to its ratio");
+    static_assert(gear_train::Observer_Of<Specs...>::consistent,
+                  "a gear's handlers must all be members of the same class");
+
+    /*
+     * Sets the object notified of the gear's events. 'observer' cannot be null and its lifetime
+     * must extend beyond the gear's.
+     */
+    template <class T = observer_type>
+    void observe(T* observer) { this->observer = observer; }
+
+    /*
+     * Returns the 'I'th gear driven by this one, in tick order.
+     */
+    template <size_t I>
+    typename std::tuple_element<I, children_type>::type& child() { return std::get<I>(children); }
+
+    /*
+     * Behave as the Base_Gear methods of the same names.
+     */
+    void delay_engagement() { if (state == Engaged) state = Engaging; }
+
+    void engage(bool engaged)
+    {
+        if (!engaged)
+        {
+            if (state == Engaged || state == Engaging)
+            {
+                state = Disengaging;
+            }
+        }
+        else
+        {
+            if (state == Disengaged)
+            {
+                state = Engaging;
+            }
+            else if (state == Disengaging)
+            {
+                state = Engaged;
+            }
+        }
+    }
+
+    bool is_disengaged() const { return state == Disengaged; }
+
+    bool is_engaged() const { return state == Engaged; }
+
+    bool is_engaging() const { return state == Engaging; }
+
+    uint16_t get_phase() const { return phase; }
+
+    uint16_t get_ratio() const { return ratio; }
+
+    uint16_t get_step() const { return step; }
+
+    /*
+     * Returns the total number of rotations while engaged, if the gear counts them.
+     */
+    template <bool C = counted>
+    typename std::enable_if<C, uint64_t>::type count() const { return this->total; }
+
+    /*
+     * Ticks the gear, and on rotation, the gears it drives, in the same order as Base_Gear::tick().
+     */
+    inline void tick()
+    {
+        if (phase + step >= ratio)
+        {
+            if (state == Engaging)
+            {
+                state = Engaged;
+                fire<On_Engaged>();
+            }
+            if (state == Engaged)
+            {
+                fire<On_Tick>();
+                fire<On_Rotation>();
+                count_rotation();
+            }
+            if (state == Disengaging)
+            {
+                state = Disengaged;
+                fire<On_Disengaged>();
+            }
+
+            phase = (phase + step) - ratio;
+
+            std::apply([](auto&... gears) { (gears.tick(), ...); }, children);
+        }
+        else
+        {
+            if (state == Engaged)
+            {
+                fire<On_Tick>();
+            }
+            else if (state == Disengaging)
+            {
+                state = Disengaged;
+                fire<On_Disengaged>();
+            }
+
+            phase += step;
+        }
+    }
+
+private:
+
+    enum Gear_State : uint8_t { Disengaged, Engaging, Engaged, Disengaging };
+
+    template <template <auto> class Kind>
+    inline void fire()
+    {
+        typedef gear_train::Find_Handler<Kind, Specs...> Found;
+        if constexpr (Found::found)
+        {
+            (this->observer->*Found::handler)();
+        }
+    }
+
+    inline void count_rotation()
+    {
+        if constexpr (counted)
+        {
+            this->total += 1;
+        }
+    }
+
+    uint16_t phase = start_phase;
+    Gear_State state = Engaged;
+    children_type children;
+};
+
+/*
+ * A train is declared as its drive gear.
+ */
+template <class... Specs>
+using Train = Train_Gear<Specs...>;
+
+#endif // _WELLWOOD_GEAR_TRAIN_H_ //
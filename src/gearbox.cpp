@@ -7,130 +7,2623 @@
  */
 
 #include "gearbox.h"
+#include "command_queue.h"
+#include "handler_pool.h"
+#include "work_pool.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <functional>
+#include <numeric>
+#include <stdexcept>
 #include <cstdio>
+#include <cstddef>
+#include <thread>
+#include <typeinfo>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Base_Gear::Base_Gear(uint16_t phase, uint16_t step)
+: state(Engaged)
+, handled(All_Events)
+, pass(0)
+, ticked(0)
+, ratio(1)
+, step((step > 0) ? step : 1)
+, phase(phase)
+, priority(0)
+, node(0)
+, driven(nullptr)
+, next(nullptr)
+, prev(nullptr)
+, pinion(nullptr)
+, cursor(nullptr)
+, gearbox(nullptr)
+{ }
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Base_Gear::connect(Base_Gear* pinion, uint16_t ratio, uint16_t phase, uint16_t step, uint16_t priority)
+{
+    // a compiled gear is connected through its gearbox, which keeps its own copy of the tree
+    assert(gearbox == nullptr && (pinion == nullptr || pinion->gearbox == nullptr));
+    disconnect();
+
+    this->ratio = (ratio > 0) ? ratio : 1;
+    this->phase = phase;
+    this->step = (step > 0) ? step : 1;
+    this->priority = priority;
+
+    link(pinion);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Base_Gear::link(Base_Gear* pinion)
+{
+    // if the drive gear is ticking its driven gears, this one is passed over until the next pass
+    this->pinion = pinion;
+    ticked = pinion->pass;
+
+    Base_Gear* first = pinion->driven;
+    if (first == nullptr)
+    {
+        next = nullptr;
+        prev = this;
+        pinion->driven = this;
+        return;
+    }
+
+    // search back from the last gear, so a gear with the highest priority is linked immediately
+    Base_Gear* g = first->prev;
+    while (g != first && g->priority > priority)
+    {
+        g = g->prev;
+    }
+
+    if (g->priority > priority)
+    {
+        next = first;
+        prev = first->prev;
+        first->prev = this;
+        pinion->driven = this;
+    }
+    else
+    {
+        next = g->next;
+        prev = g;
+        if (next != nullptr)
+        {
+            next->prev = this;
+        }
+        else
+        {
+            first->prev = this;
+        }
+        g->next = this;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Base_Gear::disconnect()
+{
+    assert(gearbox == nullptr && (pinion == nullptr || pinion->gearbox == nullptr));
+    if (pinion == nullptr)
+    {
+        return;
+    }
+
+    Base_Gear* first = pinion->driven;
+
+    // if the drive gear is ticking its driven gears and has just ticked this one, it continues
+    // from the gear before
+    if (pinion->cursor == this)
+    {
+        pinion->cursor = (this == first) ? nullptr : prev;
+    }
+
+    if (next != nullptr)
+    {
+        next->prev = prev;
+    }
+    else
+    {
+        first->prev = prev;
+    }
+
+    if (this == first)
+    {
+        pinion->driven = next;
+    }
+    else
+    {
+        prev->next = next;
+    }
+
+    next = nullptr;
+    prev = nullptr;
+    pinion = nullptr;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Base_Gear::engage(bool engaged)
+{
+    if (gearbox != nullptr)
+    {
+        gearbox->sync(node);
+    }
+    Gear_State& state = current_state();
+
+    if (!engaged)
+    {
+        if (state == Engaged || state == Engaging)
+        {
+            // in the event that on_engaged() was called and it delayed the gear engagement by
+            // one more rotation, the gear will still be in the Engaging state and may require
+            // the corresponding on_disengaged() handler to be called as well.
+            state = Disengaging;
+        }
+    }
+    else
+    {
+        if (state == Disengaged)
+        {
+            state = Engaging;
+        }
+        else if (state == Disengaging)
+        {
+            // hasn't disengaged yet, so go straight back to engaged
+            state = Engaged;
+        }
+    }
+
+    if (gearbox != nullptr)
+    {
+        gearbox->publish(node);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Base_Gear::retune(uint16_t ratio, uint16_t step)
+{
+    this->ratio = (ratio > 0) ? ratio : 1;
+    this->step = (step > 0) ? step : 1;
+
+    if (gearbox != nullptr)
+    {
+        gearbox->retune(node);
+    }
+    else if (phase >= this->ratio)
+    {
+        phase = this->ratio - 1;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Base_Gear::tick()
+{
+    if (!turn() || driven == nullptr)
+    {
+        return;
+    }
+
+    // the stack holds the rotated gears whose driven gears are being ticked, each of which keeps
+    // its place in them in its cursor. it is kept between ticks, so it grows to the depth of the
+    // deepest tree ticked and is then reused. a handler can tick another tree, which stacks its
+    // gears above these and removes them before returning.
+    thread_local std::vector<Base_Gear*> stack;
+    const size_t base = stack.size();
+    stack.push_back(this);
+
+    while (stack.size() > base)
+    {
+        // the gear to tick next is found from the last one visited, after its handlers and those
+        // of the gears it drives have run, so they can connect and disconnect gears. gears
+        // connected during the pass are marked with it, and are not ticked until the next.
+        Base_Gear* p = stack.back();
+        Base_Gear* g = (p->cursor != nullptr) ? p->cursor->next : p->driven;
+        if (g == nullptr)
+        {
+            stack.pop_back();
+            continue;
+        }
+
+        p->cursor = g;
+        if (g->ticked != p->pass)
+        {
+            g->ticked = p->pass;
+            if (g->turn() && g->driven != nullptr)
+            {
+                stack.push_back(g);
+            }
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+bool Base_Gear::turn()
+{
+    // a handler can retune the gear, so its phase is advanced by the step and ratio it was ticked
+    // with, and then kept below a new ratio, as retune() does
+    const uint16_t turned = ratio;
+    uint32_t next = phase + step;
+    if (next >= turned)
+    {
+        if (state == Engaging)
+        {
+            state = Engaged;
+            if (handled & Engaged_Event) on_engaged();
+        }
+        if (state == Engaged)
+        {
+            if (handled & Tick_Event) on_tick();
+            if (handled & Rotation_Event) on_rotation();
+        }
+        if (state == Disengaging)
+        {
+            state = Disengaged;
+            if (handled & Disengaged_Event) on_disengaged();
+        }
+
+        phase = (uint16_t)(next - turned);
+        if (ratio != turned && phase >= ratio)
+        {
+            phase = ratio - 1;
+        }
+
+        // starts a pass over the driven gears
+        pass ^= 1;
+        cursor = nullptr;
+        return true;
+    }
+
+    if (state == Engaged)
+    {
+        if (handled & Tick_Event) on_tick();
+    }
+    else if (state == Disengaging)
+    {
+        state = Disengaged;
+        if (handled & Disengaged_Event) on_disengaged();
+    }
+
+    phase = (uint16_t)next;
+    if (ratio != turned && phase >= ratio)
+    {
+        phase = ratio - 1;
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------------------------//
+
+Gearbox::Gearbox(Base_Gear* drive)
+: Gearbox(std::vector<Base_Gear*>(1, drive))
+{ }
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Gearbox::Gearbox(const std::vector<Base_Gear*>& drives)
+: copies((uint32_t)drives.size())
+, clock(0)
+, visiting(0)
+, reobserve(false)
+, scheduled(false)
+, cursor(0)
+, cycle(0)
+, limit(0)
+, profiled(false)
+, deferred(false)
+, pool(nullptr)
+, parallel(false)
+, commands(nullptr)
+, repark(false)
+, sequence(0)
+, completed(0)
+{
+    // walk each tree depth first with an explicit stack, so the depth of the tree is not limited
+    // by the depth of the native stack. each gear's driven gears are pushed in reverse so they are
+    // popped in tick order. the trees have the same shape, so the gears at the same place in each
+    // are then laid out one after another, gear j of instance k at j * copies + k.
+    std::vector<Base_Gear*> stack;
+    std::vector<uint32_t> stack_parents;
+    std::vector<Base_Gear*> children;
+    std::vector<std::vector<Base_Gear*>> orders(copies);
+    std::vector<uint32_t> shape;
+
+    for (uint32_t k = 0; k < copies; k++)
+    {
+        std::vector<Base_Gear*>& order = orders[k];
+        bool same = true;
+        stack.push_back(drives[k]);
+        stack_parents.push_back(0);
+        while (!stack.empty())
+        {
+            Base_Gear* g = stack.back();
+            uint32_t parent = stack_parents.back();
+            stack.pop_back();
+            stack_parents.pop_back();
+
+            // each gear of a later instance must be driven by the gear at the same place as in
+            // the first, with the same ratio and step, or its place is not that of the first's
+            uint32_t j = (uint32_t)order.size();
+            if (k == 0)
+            {
+                shape.push_back(parent);
+            }
+            else if (j >= orders[0].size() || shape[j] != parent ||
+                     g->ratio != orders[0][j]->ratio || g->step != orders[0][j]->step)
+            {
+                same = false;
+                stack.clear();
+                stack_parents.clear();
+                break;
+            }
+            order.push_back(g);
+
+            children.clear();
+            for (Base_Gear* c = g->driven; c != nullptr; c = c->next)
+            {
+                children.push_back(c);
+            }
+            for (size_t c = children.size(); c > 0; c--)
+            {
+                stack.push_back(children[c - 1]);
+                stack_parents.push_back(j);
+            }
+        }
+
+        // a tree of another shape would be laid out past the end of the arrays
+        if (!same || order.size() != orders[0].size())
+        {
+            throw std::invalid_argument(
+                "every instance compiled into a Gearbox must have the same shape");
+        }
+    }
+
+    const uint32_t n = (uint32_t)orders[0].size();
+    nodes.resize(n * copies);
+    gears.resize(n * copies);
+    parents.resize(n * copies);
+    for (uint32_t k = 0; k < copies; k++)
+    {
+        for (uint32_t j = 0; j < n; j++)
+        {
+            Base_Gear* g = orders[k][j];
+            uint32_t i = j * copies + k;
+            Node& node = nodes[i];
+            node.phase = g->phase;
+            node.step = g->step;
+            node.ratio = g->ratio;
+            node.state = g->state;
+            node.handled = g->handled;
+            node.drives = (g->driven != nullptr);
+            node.collapsed = false;
+            node.skips = false;
+            node.wide = false;
+            node.end = i + 1;
+            gears[i] = g;
+            parents[i] = (j == 0) ? i : shape[j] * copies + k;
+
+            g->gearbox = this;
+            g->node = i;
+        }
+    }
+
+    // every gear driven by gear i of a single tree follows it in the array, so each gear's range
+    // ends where the last range within it ends. those of interleaved trees are not contiguous.
+    if (copies == 1)
+    {
+        for (uint32_t i = size() - 1; i > 0; i--)
+        {
+            Node& parent = nodes[parents[i]];
+            if (parent.end < nodes[i].end)
+            {
+                parent.end = nodes[i].end;
+            }
+        }
+    }
+
+    rotated.assign(size(), 0);
+    visiting = size();
+    frames.resize(size());
+    for (uint32_t k = 0; k < copies; k++)
+    {
+        frames[k] = { 0, 1, k };
+    }
+
+    if (copies == 1)
+    {
+        collapse();
+        widen();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Gearbox::~Gearbox()
+{
+    if (scheduled)
+    {
+        sync_parked();
+    }
+    expand_collapsed();
+    for (uint32_t i = 0; i < size(); i++)
+    {
+        Base_Gear* g = gears[i];
+        g->phase = nodes[i].phase;
+        g->state = nodes[i].state;
+        g->gearbox = nullptr;
+        g->node = 0;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::fire(uint32_t i, bool rotates)
+{
+    Node& node = nodes[i];
+
+    // the gears after this one have yet to be ticked, which timestamps take into account. the
+    // handlers of gears ticked in parallel cannot ask for them.
+    if (!parallel)
+    {
+        visiting = i;
+    }
+
+    if (rotates)
+    {
+        if (node.state == Base_Gear::Engaging)
+        {
+            node.state = Base_Gear::Engaged;
+            if (node.handled & Base_Gear::Engaged_Event)
+            {
+                call<Base_Gear::Engaged_Event>(i);
+            }
+        }
+        if (node.state == Base_Gear::Engaged)
+        {
+            if (node.handled & Base_Gear::Tick_Event)
+            {
+                call<Base_Gear::Tick_Event>(i);
+            }
+            if (node.handled & Base_Gear::Rotation_Event)
+            {
+                call<Base_Gear::Rotation_Event>(i);
+            }
+        }
+        if (node.state == Base_Gear::Disengaging)
+        {
+            node.state = Base_Gear::Disengaged;
+            if (node.handled & Base_Gear::Disengaged_Event)
+            {
+                call<Base_Gear::Disengaged_Event>(i);
+            }
+        }
+    }
+    else
+    {
+        if (node.state == Base_Gear::Engaged)
+        {
+            if (node.handled & Base_Gear::Tick_Event)
+            {
+                call<Base_Gear::Tick_Event>(i);
+            }
+        }
+        else if (node.state == Base_Gear::Disengaging)
+        {
+            node.state = Base_Gear::Disengaged;
+            if (node.handled & Base_Gear::Disengaged_Event)
+            {
+                call<Base_Gear::Disengaged_Event>(i);
+            }
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+template <uint8_t Event>
+inline void Gearbox::call(uint32_t i)
+{
+    if (deferred)
+    {
+        events.push_back(Record{ i, Event });
+    }
+    else
+    {
+        invoke<Event>(i);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+template <uint8_t Event>
+inline void Gearbox::invoke(uint32_t i)
+{
+    if (!offloads.empty() && offloads[i] != nullptr)
+    {
+        offloads[i]->post(gears[i], Event, i);
+        return;
+    }
+
+    // gears fast-forwarded by advance() are brought up to date before any event fires, so the
+    // handlers see the same tree that tick() would have produced
+    if (!owing.empty()) catch_up();
+
+    if (Event == Base_Gear::Engaged_Event)
+    {
+        gears[i]->on_engaged();
+    }
+    else if (Event == Base_Gear::Tick_Event)
+    {
+        gears[i]->on_tick();
+    }
+    else if (Event == Base_Gear::Rotation_Event)
+    {
+        if (profiled)
+        {
+            auto start = std::chrono::steady_clock::now();
+            gears[i]->on_rotation();
+            std::chrono::nanoseconds taken = std::chrono::steady_clock::now() - start;
+            costs[i].nanoseconds += (uint64_t)taken.count();
+            costs[i].rotations++;
+        }
+        else
+        {
+            gears[i]->on_rotation();
+        }
+    }
+    else
+    {
+        gears[i]->on_disengaged();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::offload(Base_Gear* gear, Handler_Pool* pool)
+{
+    if (offloads.empty())
+    {
+        if (pool == nullptr)
+        {
+            return;
+        }
+        offloads.assign(size(), nullptr);
+    }
+    offloads[gear->node] = pool;
+    reobserve.store(true, std::memory_order_relaxed);
+
+    // the rings of a pool are filled by one thread, so the gearbox is ticked on one thread for
+    // as long as any gear is offloaded
+    for (Handler_Pool* p : offloads)
+    {
+        if (p != nullptr)
+        {
+            return;
+        }
+    }
+    offloads.clear();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::defer(bool deferred)
+{
+    if (deferred && events.capacity() < size())
+    {
+        events.reserve(size());
+    }
+    this->deferred = deferred;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::dispatch()
+{
+    // the tick has finished, so the handlers see it complete, and make their changes as though
+    // between ticks. the buffer keeps its capacity from tick to tick.
+    visiting = size();
+    for (size_t e = 0; e < events.size(); e++)
+    {
+        uint32_t i = events[e].gear;
+        switch (events[e].event)
+        {
+        case Base_Gear::Engaged_Event:
+            invoke<Base_Gear::Engaged_Event>(i);
+            break;
+        case Base_Gear::Tick_Event:
+            invoke<Base_Gear::Tick_Event>(i);
+            break;
+        case Base_Gear::Rotation_Event:
+            invoke<Base_Gear::Rotation_Event>(i);
+            break;
+        case Base_Gear::Disengaged_Event:
+            invoke<Base_Gear::Disengaged_Event>(i);
+            break;
+        }
+    }
+    events.clear();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+inline bool Gearbox::turn(uint32_t i)
+{
+    return turn(i, nodes[i].phase + nodes[i].step >= nodes[i].ratio);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+inline bool Gearbox::turn(uint32_t i, bool rotates)
+{
+    Node& node = nodes[i];
+    const uint16_t ratio = node.ratio;
+    uint32_t phase = nodes[i].phase + node.step;
+
+    // most ticks have no handler to call and no change of state to make, so only update the phase
+    uint8_t events = Base_Gear::Tick_Event | (rotates ? Base_Gear::Rotation_Event : 0);
+    if (rotates)
+    {
+        rotated[i] = clock;
+    }
+    if (node.state != Base_Gear::Disengaged &&
+        (node.state != Base_Gear::Engaged || (node.handled & events)))
+    {
+        fire(i, rotates);
+    }
+
+    // a handler can retune the gear, which is kept below its new ratio, as retune() does
+    phase = rotates ? phase - ratio : phase;
+    if (node.ratio != ratio && phase >= node.ratio)
+    {
+        phase = node.ratio - 1;
+    }
+    nodes[i].phase = (uint16_t)phase;
+    return rotates;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::tick()
+{
+    begin_changes();
+    apply_commands();
+    clock++;
+
+    if (!entries.empty())
+    {
+        tick_tabulated();
+    }
+    else if (scheduled)
+    {
+        tick_scheduled();
+    }
+    else if (copies > 1)
+    {
+        tick_instances();
+    }
+    else if (pool == nullptr || deferred || !offloads.empty())
+    {
+        tick_range(0, size());
+    }
+    else if (turn(0))
+    {
+        parallel = true;
+        pool->run((uint32_t)groups.size() - 1, &Gearbox::tick_group, this);
+        parallel = false;
+    }
+
+    // gears retuned by handlers take their new ratios as the tick finishes, so they are never
+    // seen with a phase beyond their ratio between ticks
+    if (!retuned.empty())
+    {
+        repark_gears();
+    }
+    visiting = size();
+    if (!events.empty())
+    {
+        dispatch();
+    }
+    end_changes();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::tick_range(uint32_t first, uint32_t last)
+{
+    uint32_t i = first;
+    while (i < last)
+    {
+        // a gear that rotates continues into the gears driven by it, otherwise they are skipped.
+        // the next gear after one that drives none is known without waiting for its end to load.
+        // a run of collapsed gears is only tallied.
+        if (nodes[i].skips)
+        {
+            tally(i);
+            i = folds[i].run;
+        }
+        else if (nodes[i].wide)
+        {
+            i = tick_wide(i, std::min(spans[i], last));
+        }
+        else if (turn(i) || !nodes[i].drives)
+        {
+            i++;
+        }
+        else
+        {
+            i = nodes[i].end;
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::tick_group(void* gearbox, uint32_t group)
+{
+    Gearbox* box = static_cast<Gearbox*>(gearbox);
+    box->tick_range(box->groups[group], box->groups[group + 1]);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::parallelize(Work_Pool* pool, uint32_t grain)
+{
+    this->pool = (copies == 1) ? pool : nullptr;
+    groups.clear();
+    if (this->pool == nullptr)
+    {
+        return;
+    }
+
+    // the subtrees of the gears driven by the drive gear follow it one after another. they are
+    // grouped in order, each group closed once it holds at least 'grain' gears, and a run of
+    // collapsed gears is kept whole.
+    groups.push_back(1);
+    uint32_t i = 1;
+    while (i < size())
+    {
+        i = nodes[i].skips ? folds[i].run : nodes[i].end;
+        if (i - groups.back() >= grain || i == size())
+        {
+            groups.push_back(i);
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::advance(uint64_t ticks)
+{
+    if (copies > 1)
+    {
+        for (; ticks > 0; ticks--)
+        {
+            tick();
+        }
+        return;
+    }
+
+    begin_changes();
+    apply_commands();
+    const uint64_t advanced = ticks;
+
+    if (scheduled)
+    {
+        sync_parked();
+    }
+    expand_collapsed();
+    observe();
+
+    if (!observed[0])
+    {
+        if (ticks > 0)
+        {
+            owed[0] += ticks;
+            owing.push_back(0);
+            clock += ticks;
+        }
+    }
+    else
+    {
+        while (ticks > 0)
+        {
+            // the ticks before the next event are advanced in closed form, leaving the unobserved
+            // subtrees to catch up before the event fires
+            uint64_t quiet = horizon() - 1;
+            if (quiet > ticks)
+            {
+                quiet = ticks;
+            }
+            if (quiet > 0)
+            {
+                clock += quiet;
+                owed[0] = quiet;
+                settle(0, true);
+                ticks -= quiet;
+            }
+            if (ticks > 0)
+            {
+                clock++;
+                tick_observed();
+                if (!events.empty())
+                {
+                    dispatch();
+                }
+                if (reobserve.load(std::memory_order_relaxed))
+                {
+                    observe();
+                }
+                ticks--;
+            }
+        }
+    }
+    catch_up();
+
+    // the collapsed gears have been advanced along with the rest, and are tallied from here
+    if (folds != nullptr)
+    {
+        for (uint32_t i = 1; i < size(); i++)
+        {
+            publish(i);
+        }
+    }
+
+    if (scheduled)
+    {
+        park();
+    }
+    if (!entries.empty())
+    {
+        cycle = (cycle + advanced % (entries.size() - 1)) % (entries.size() - 1);
+    }
+    end_changes();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::snapshot(const std::vector<const Counter*>& counters,
+                           std::vector<uint64_t>& counts) const
+{
+    counts.resize(counters.size());
+    for (;;)
+    {
+        uint64_t before = sequence.load(std::memory_order_acquire);
+        if (before & 1)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        uint64_t ticks = completed.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < counters.size(); i++)
+        {
+            counts[i] = counters[i]->count();
+        }
+
+        // the counts hold if no tick began while they were read
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) == before)
+        {
+            return ticks;
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::next_event()
+{
+    if (scheduled)
+    {
+        sync_parked();
+    }
+    observe();
+    return horizon();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint8_t Gearbox::observed_events(uint32_t i) const
+{
+    // the handlers of an offloaded gear are called one event at a time, posted as it fires, so
+    // its rotations cannot be reported in a batch
+    if (!offloads.empty() && offloads[i] != nullptr && !nodes[i].collapsed)
+    {
+        return nodes[i].handled;
+    }
+    return gears[i]->observed_events();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::observe()
+{
+    const uint32_t n = size();
+
+    observed.resize(n);
+    owed.resize(n, 0);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        observed[i] = (observed_events(i) != 0);
+    }
+    for (uint32_t i = n - 1; i > 0; i--)
+    {
+        observed[parents[i]] |= observed[i];
+    }
+    reobserve.store(false, std::memory_order_relaxed);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::handle_more(uint32_t i, uint8_t events)
+{
+    // the handlers of a gearbox ticked in parallel can all set this at once. it is only read by
+    // advance(), on the ticking thread, once they have been joined.
+    reobserve.store(true, std::memory_order_relaxed);
+
+    // a parked gear is only ticked on its rotations, so one that comes to handle its other ticks
+    // is left in the tree when the gears are parked again, at the start of the next tick
+    if (scheduled && parked[i] && (events & (Base_Gear::Tick_Event | Base_Gear::Disengaged_Event)))
+    {
+        repark = true;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::horizon()
+{
+    const uint32_t n = size();
+    uint64_t next = Never;
+
+    due.resize(n);
+
+    // a gear's first tick is the first rotation of its drive gear. a gear cannot fire an event
+    // before its first tick, nor can any gear it drives, so gears that make their first tick no
+    // sooner than the earliest event found so far are skipped along with the gears they drive.
+    uint32_t i = 0;
+    while (i < n)
+    {
+        uint64_t first_tick = is_drive(i) ? 1 : due[parents[i]];
+        if (!observed[i] || first_tick >= next)
+        {
+            due[i] = Never;
+            i = nodes[i].end;
+            continue;
+        }
+
+        uint8_t events = observed_events(i);
+        Gear_State state = nodes[i].state;
+        if ((state == Base_Gear::Engaged && (events & Base_Gear::Tick_Event)) ||
+            (state == Base_Gear::Disengaging && (events & Base_Gear::Disengaged_Event)))
+        {
+            next = first_tick;
+            due[i] = Never;
+            i = nodes[i].end;
+            continue;
+        }
+
+        uint64_t ticks = ticks_to_rotate(i, 1);
+        due[i] = (ticks == 1) ? first_tick : tick_time(i, ticks);
+        if ((state == Base_Gear::Engaged && (events & Base_Gear::Rotation_Event)) ||
+            (state == Base_Gear::Engaging && (events & ~Base_Gear::Disengaged_Event)))
+        {
+            if (due[i] < next)
+            {
+                next = due[i];
+            }
+        }
+        i++;
+    }
+    return next;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::ticks_to_rotate(uint32_t i, uint64_t rotations) const
+{
+    return ticks_to_rotate(i, nodes[i].phase, rotations);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::ticks_to_rotate(uint32_t i, uint64_t phase, uint64_t rotations) const
+{
+    uint64_t ratio = nodes[i].ratio;
+    uint64_t step = nodes[i].step;
+    uint64_t ticks = 0;
+
+    if (rotations == Never || step >= ratio)
+    {
+        return rotations;
+    }
+
+    // a phase at or past the ratio makes a rotation on every tick until it falls back into range
+    while (phase >= ratio && rotations > 0)
+    {
+        phase = (phase + step) - ratio;
+        ticks++;
+        rotations--;
+    }
+    if (rotations == 0)
+    {
+        return ticks;
+    }
+    if (rotations > (Never / 2) / ratio)
+    {
+        return Never;
+    }
+    return ticks + (rotations * ratio - phase + step - 1) / step;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::tick_time(uint32_t i, uint64_t ticks) const
+{
+    // the nth tick of a gear is the nth rotation of its drive gear
+    while (!is_drive(i) && ticks != Never)
+    {
+        i = parents[i];
+        ticks = ticks_to_rotate(i, ticks);
+    }
+    return ticks;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::tick_observed()
+{
+    const uint32_t n = size();
+    uint32_t i = 0;
+    while (i < n)
+    {
+        if (!observed[i])
+        {
+            if (owed[i]++ == 0)
+            {
+                owing.push_back(i);
+            }
+            i = nodes[i].end;
+        }
+        else
+        {
+            // a handler can come to observe a gear, which is ticked from here on. the gears
+            // fast-forwarded so far have been brought up to date before it was called.
+            bool rotates = turn(i);
+            if (reobserve.load(std::memory_order_relaxed))
+            {
+                observe();
+            }
+            i = rotates ? i + 1 : nodes[i].end;
+        }
+    }
+    visiting = n;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::tick_of(uint32_t i, uint64_t ago) const
+{
+    // a frame that ends short of a drive gear counts back to rotations of a gear whose ticks
+    // between them are uneven. after its latest rotation, a gear's phase is below its step, and
+    // grows by its step every tick, so a number of its rotations ago is a number of its own ticks
+    // ago, which its own frame counts back.
+    const Frame* frame = &frames[i];
+    uint64_t back = mul_add(frame->base, ago, frame->scale);
+    while (!is_drive(frame->anchor))
+    {
+        uint32_t p = parents[frame->anchor];
+        uint64_t ticks = mul_add(nodes[p].phase, back, nodes[p].ratio);
+        ticks = (ticks == Never) ? Never : ticks / nodes[p].step;
+        frame = &frames[p];
+        back = mul_add(frame->base, ticks, frame->scale);
+    }
+
+    // the drive gear ticks on every tick, and until its events have fired, the one in progress
+    // has yet to be made
+    uint64_t latest = (visiting > frame->anchor) ? clock : clock - 1;
+    return (back < latest) ? latest - back : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::frame_drivers(uint32_t first)
+{
+    // walking up from 'first', 'frame' counts the ticks of gear 'start' back to those of gear 'g'.
+    // a gear that has yet to be ticked on the tick in progress, when its drive gear rotated on it,
+    // is a rotation behind its drive gear. where the drive gear's ticks between its rotations are
+    // uneven, the frame ends, and the drive gear starts one of its own. the frame of a drive gear
+    // never changes.
+    uint32_t start = first;
+    Frame frame = { 0, 1, first };
+    uint32_t g = first;
+    while (!is_drive(g))
+    {
+        uint32_t p = parents[g];
+        bool behind = g >= visiting && p < visiting && rotated[p] == clock;
+        frame.base = mul_add(frame.base, behind ? 1 : 0, 1);
+        if (!carry(p, frame))
+        {
+            frame.anchor = g;
+            frames[start] = frame;
+            start = p;
+            frame = { 0, 1, p };
+        }
+        g = p;
+    }
+    if (!is_drive(start))
+    {
+        frame.anchor = g;
+        frames[start] = frame;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::frame(uint32_t i)
+{
+    // each tick of a gear is a rotation of its drive gear, so the tick 'ago' ticks back is the
+    // rotation 'ago' rotations back
+    uint32_t p = parents[i];
+    Frame frame = { 0, 1, i };
+    if (carry(p, frame))
+    {
+        const Frame& up = frames[p];
+        frame.base = mul_add(up.base, frame.base, up.scale);
+        frame.scale = mul_add(0, frame.scale, up.scale);
+        frame.anchor = up.anchor;
+    }
+    frames[i] = frame;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+bool Gearbox::carry(uint32_t p, Frame& frame) const
+{
+    // a gear whose phase is at or past its ratio, or whose step is, rotates on every tick, and one
+    // with a step of 1 rotates every 'ratio' ticks, 'phase' ticks after its latest rotation
+    uint64_t ratio = nodes[p].ratio;
+    uint64_t phase = nodes[p].phase;
+    if (phase >= ratio || nodes[p].step >= ratio)
+    {
+        return true;
+    }
+    if (nodes[p].step > 1)
+    {
+        return false;
+    }
+    frame.base = mul_add(phase, frame.base, ratio);
+    frame.scale = mul_add(0, frame.scale, ratio);
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::next_rotation(uint32_t i)
+{
+    // the phases are taken as they will stand once the tick in progress has finished. a gear that
+    // has yet to be ticked on it is, if its drive gear rotates on it. the gears driving a gear
+    // come before it, so those already ticked are the ones nearest the drive gear, and the nearest
+    // of them to this gear rotated on it or not. below that, each rotates if its drive gear does
+    // and its step carries it to its ratio. walking up, the gears are brought up to date, and
+    // 'stuck' becomes the topmost gear yet to be ticked whose step does not.
+    const uint32_t none = size();
+    uint32_t stuck = none;
+    bool rotates = true;
+    for (uint32_t g = i;; g = parents[g])
+    {
+        sync(g);
+        if (g < visiting)
+        {
+            rotates = (clock > 0 && rotated[g] == clock);
+            break;
+        }
+        if (nodes[g].phase + nodes[g].step < nodes[g].ratio)
+        {
+            stuck = g;
+        }
+        if (is_drive(g))
+        {
+            break;
+        }
+    }
+
+    // the nth tick of a gear is the nth rotation of its drive gear. the gears yet to be ticked
+    // below 'stuck' are not.
+    uint64_t ticks = 1;
+    bool below = (stuck != none);
+    for (uint32_t g = i; ticks != Never; g = parents[g])
+    {
+        uint64_t phase = nodes[g].phase;
+        if (g >= visiting)
+        {
+            below = below && g != stuck;
+            if (rotates && !below)
+            {
+                phase += nodes[g].step;
+                if (phase >= nodes[g].ratio)
+                {
+                    phase -= nodes[g].ratio;
+                }
+            }
+        }
+        ticks = ticks_to_rotate(g, phase, ticks);
+        if (is_drive(g))
+        {
+            break;
+        }
+    }
+    return (ticks > Never - clock) ? Never : clock + ticks;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::wind(uint64_t ratio, uint64_t step, uint64_t& phase, uint64_t ticks)
+{
+    // a step as large as the ratio makes a rotation on every tick, and moves the phase on by what
+    // is left over, in the 16 bits it is kept in
+    if (step >= ratio)
+    {
+        phase = (phase + ticks * (step - ratio)) & 0xFFFF;
+        return ticks;
+    }
+
+    // a phase at or past the ratio also makes a rotation on every tick, and falls by the ratio less
+    // the step, until it is below that difference
+    uint64_t rotations = 0;
+    if (phase >= ratio)
+    {
+        uint64_t fall = ratio - step;
+        rotations = std::min(ticks, phase / fall);
+        phase -= rotations * fall;
+        ticks -= rotations;
+    }
+    if (ticks > 0)
+    {
+        // phase + ticks * step, split so the product cannot overflow
+        uint64_t laps = ticks / ratio;
+        uint64_t rest = phase + (ticks % ratio) * step;
+        rotations += laps * step + rest / ratio;
+        phase = rest % ratio;
+    }
+    return rotations;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::mul_add(uint64_t base, uint64_t count, uint64_t by)
+{
+    if (count != 0 && by > (Never - base) / count)
+    {
+        return Never;
+    }
+    return base + count * by;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::spin(uint32_t i, uint64_t ticks)
+{
+    if (ticks == 0)
+    {
+        return 0;
+    }
+
+    uint64_t phase = nodes[i].phase;
+    uint64_t rotations = wind(nodes[i].ratio, nodes[i].step, phase, ticks);
+    nodes[i].phase = (uint16_t)phase;
+
+    // the gear engages on its first rotation, which it counts, and disengages on its first tick,
+    // before it counts anything. neither may fire an observed event, or the gear would not have
+    // been advanced in closed form.
+    if (nodes[i].state == Base_Gear::Disengaging)
+    {
+        nodes[i].state = Base_Gear::Disengaged;
+    }
+    else if (nodes[i].state == Base_Gear::Engaging && rotations > 0)
+    {
+        nodes[i].state = Base_Gear::Engaged;
+    }
+    if (nodes[i].state == Base_Gear::Engaged && rotations > 0)
+    {
+        gears[i]->on_rotations(rotations);
+    }
+    return rotations;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::settle(uint32_t first, bool observed_only)
+{
+    // each gear is advanced before the gears it drives, which are owed one tick for each of its
+    // rotations. the ticks of 'first' are counted back through the gears driving it, and those
+    // of each gear after it through the frame of its drive gear, found as it was advanced.
+    frame_drivers(first);
+    uint32_t i = first;
+    while (i < nodes[first].end)
+    {
+        uint64_t ticks = owed[i];
+        if (ticks == 0 || (observed_only && !observed[i]))
+        {
+            i = nodes[i].end;
+            continue;
+        }
+        owed[i] = 0;
+        if (i != first)
+        {
+            frame(i);
+        }
+
+        uint64_t rotations = spin(i, ticks);
+        if (rotations > 0)
+        {
+            // the gear last rotated on its latest tick, or on as many before it as it has stepped
+            // since
+            uint64_t phase = nodes[i].phase;
+            rotated[i] = tick_of(i, (phase < nodes[i].ratio) ? phase / nodes[i].step : 0);
+        }
+
+        for (uint32_t c = i + 1; c < nodes[i].end; c = nodes[c].end)
+        {
+            if (observed_only && !observed[c] && owed[c] == 0 && rotations > 0)
+            {
+                owing.push_back(c);
+            }
+            owed[c] += rotations;
+        }
+        i++;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::catch_up()
+{
+    // the gears with ticks owed drive no observed gears, so their subtrees can be brought up to
+    // date in any order
+    while (!owing.empty())
+    {
+        uint32_t first = owing.back();
+        owing.pop_back();
+        settle(first, false);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::schedule(bool scheduled)
+{
+    // a tabulated gearbox parks its gears too, though it is not scheduled, and scheduling it
+    // removes its table
+    if (!entries.empty())
+    {
+        if (!scheduled)
+        {
+            return;
+        }
+        tabulate(0);
+    }
+
+    if (this->scheduled)
+    {
+        sync_parked();
+    }
+    this->scheduled = scheduled && copies == 1;
+    if (this->scheduled)
+    {
+        park();
+    }
+    else
+    {
+        wheel.reset(0);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::park()
+{
+    const uint32_t n = size();
+
+    turns.assign(n, 0);
+    synced.assign(n, 0);
+    last.assign(n, 0);
+    cursor = n;
+    repark = !retuned.empty();      // gears retuned by handlers are still retuned after the tick
+    wheel.reset(0);
+    if (!entries.empty())
+    {
+        return;
+    }
+
+    parked.assign(n, 0);
+    jumps.resize(n + 1);
+
+    // a parked gear is only visited when it rotates, so it must not observe its other ticks, and
+    // it must rotate seldom enough to be worth the trip through the wheel. collapsed gears are
+    // never visited.
+    for (uint32_t i = 1; i < n; i++)
+    {
+        uint8_t events = gears[i]->observed_events();
+        if (!nodes[i].collapsed &&
+            !(events & (Base_Gear::Tick_Event | Base_Gear::Disengaged_Event)) &&
+            nodes[i].ratio >= 4 * nodes[i].step)
+        {
+            uint64_t ticks = tick_time(i, ticks_to_rotate(i, 1));
+            parked[i] = 1;
+            if (ticks != Never)
+            {
+                wheel.insert(i, ticks);
+            }
+        }
+    }
+
+    jumps[n] = n;
+    for (uint32_t i = n; i > 0; i--)
+    {
+        jumps[i - 1] = parked[i - 1] ? jumps[nodes[i - 1].end] : i - 1;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::sync(uint32_t i)
+{
+    if (nodes[i].collapsed)
+    {
+        expand(i);
+        return;
+    }
+    if (!scheduled || !parked[i])
+    {
+        return;
+    }
+
+    // a parked gear has been ticked once for every rotation of its drive gear since it was last
+    // brought up to date, and it has not rotated since, or it would have been woken. if its drive
+    // gear rotated on the tick in progress, the gear's own tick is still to come unless the gears
+    // before it have all been ticked.
+    uint32_t p = parents[i];
+    uint64_t ticks = turns[p] - synced[i];
+    if (ticks > 0 && i > cursor && last[p] == clock)
+    {
+        ticks--;
+    }
+    spin(i, ticks);
+    synced[i] += ticks;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::retune(uint32_t i)
+{
+    // a parked gear is found in the timing wheel by the tick it rotates on, and the events listed
+    // in a table are those of the old ratio, so while a scheduled or tabulated gearbox is ticking,
+    // gears are retuned once it has finished
+    if (scheduled && cursor < size())
+    {
+        retuned.push_back(i);
+        repark = true;
+        return;
+    }
+
+    // the collapsed gears below it are worked out from the rotations of the gears driving them,
+    // so they are brought up to date with the old ratio first
+    sync(i);
+    expand_collapsed(i);
+
+    Node& node = nodes[i];
+    node.ratio = gears[i]->ratio;
+    node.step = gears[i]->step;
+    if (node.phase >= node.ratio)
+    {
+        node.phase = node.ratio - 1;
+    }
+    publish(i);
+
+    if (scheduled)
+    {
+        repark = true;
+    }
+    tabulate(0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::apply_commands()
+{
+    if (commands != nullptr)
+    {
+        commands->drain();
+    }
+    repark_gears();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::repark_gears()
+{
+    if (repark)
+    {
+        repark = false;
+        if (scheduled)
+        {
+            sync_parked();
+        }
+        for (uint32_t i : retuned)
+        {
+            retune(i);
+        }
+        retuned.clear();
+
+        // a retuned gear removes the table, so the gearbox is only still tabulated if a parked
+        // gear came to handle its ticks, and those must be listed
+        if (!entries.empty())
+        {
+            tabulate(limit);
+        }
+        else if (scheduled)
+        {
+            park();
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::sync_parked()
+{
+    for (uint32_t i = 1; i < size(); i++)
+    {
+        if (parked[i])
+        {
+            sync(i);
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::tick_scheduled()
+{
+    woken.clear();
+    wheel.tick(woken);
+    std::sort(woken.begin(), woken.end());
+
+    // the gears that are not parked are ticked as by tick(), skipping parked gears and the gears
+    // they drive. woken gears are merged in tick order: each interrupts the range being ticked
+    // with the range of gears it drives, which resumes once they have been ticked.
+    const uint32_t n = size();
+    uint32_t i = 0;
+    uint32_t end = n;
+    size_t w = 0;
+    for (;;)
+    {
+        uint32_t next = (w < woken.size()) ? woken[w] : n;
+        if (next < i && next < end)
+        {
+            w++;
+            resume.push_back(i);
+            resume.push_back(end);
+            i = wake(next) ? jumps[next + 1] : nodes[next].end;
+            end = nodes[next].end;
+        }
+        else if (i < end)
+        {
+            cursor = i;
+            if (nodes[i].skips)
+            {
+                tally(i);
+                i = jumps[folds[i].run];
+            }
+            else if (turn(i))
+            {
+                turns[i]++;
+                last[i] = clock;
+                i = jumps[i + 1];
+            }
+            else
+            {
+                i = jumps[nodes[i].end];
+            }
+        }
+        else if (!resume.empty())
+        {
+            end = resume.back();
+            resume.pop_back();
+            i = resume.back();
+            resume.pop_back();
+        }
+        else
+        {
+            break;
+        }
+    }
+    cursor = n;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+bool Gearbox::wake(uint32_t i)
+{
+    // the gear is brought up to date for the ticks it made since it was last visited, all but the
+    // current one, which is made with its events
+    cursor = i;
+    spin(i, turns[parents[i]] - synced[i] - 1);
+    synced[i] = turns[parents[i]];
+
+    bool rotated = turn(i);
+    if (rotated)
+    {
+        turns[i]++;
+        last[i] = clock;
+    }
+
+    // every gear driving this one has rotated on this tick, so their phases are up to date
+    uint64_t ticks = tick_time(i, ticks_to_rotate(i, 1));
+    if (ticks != Never)
+    {
+        wheel.insert(i, wheel.get_now() + ticks);
+    }
+    return rotated;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::collapse()
+{
+    const uint32_t n = size();
+
+    // a counter can be collapsed if every gear it drives can be, and none is too far below it. the
+    // gears a gear drives follow it, so they have all been decided by the time it is. a class
+    // derived from Counter may do more with its rotations than count them.
+    std::vector<uint32_t> heights(n, 1);
+    for (uint32_t i = n - 1; i > 0; i--)
+    {
+        if (typeid(*gears[i]) != typeid(Counter))
+        {
+            heights[i] = Max_Collapsed_Height + 1;
+        }
+        uint32_t& parent = heights[parents[i]];
+        if (parent < heights[i] + 1)
+        {
+            parent = heights[i] + 1;
+        }
+    }
+
+    bool any = false;
+    for (uint32_t i = 1; i < n; i++)
+    {
+        nodes[i].collapsed = (heights[i] <= Max_Collapsed_Height);
+        any = any || nodes[i].collapsed;
+    }
+    if (!any)
+    {
+        return;
+    }
+    folds.reset(new Fold[n]());
+
+    // expand() settles the gears it brings up to date through the ticks owed to them, which
+    // subtrees ticked in parallel do at once, so the array is never resized during a tick
+    owed.assign(n, 0);
+
+    // the collapsed gears driven by a gear that is not, one after another, make a run, which is
+    // tallied on each rotation of that gear
+    for (uint32_t p = 0; p < n; p++)
+    {
+        if (nodes[p].collapsed)
+        {
+            continue;
+        }
+
+        uint32_t start = n;
+        for (uint32_t c = p + 1; c < nodes[p].end; c = nodes[c].end)
+        {
+            if (!nodes[c].collapsed)
+            {
+                start = n;
+                continue;
+            }
+            if (start == n)
+            {
+                start = c;
+                nodes[c].skips = true;
+            }
+            folds[c].run = start;
+            folds[start].run = nodes[c].end;
+        }
+    }
+
+    for (uint32_t i = 1; i < n; i++)
+    {
+        publish(i);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::widen()
+{
+    const uint32_t n = size();
+
+    uint32_t i = 1;
+    while (i < n)
+    {
+        uint32_t end = i;
+        while (end < n && !nodes[end].drives && !nodes[end].collapsed)
+        {
+            end++;
+        }
+        if (end - i >= Lanes)
+        {
+            spans.resize(n);
+            nodes[i].wide = true;
+            spans[i] = end;
+        }
+        i = (end > i) ? end : i + 1;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint32_t Gearbox::tick_wide(uint32_t i, uint32_t last)
+{
+    // most gears of a wide run neither rotate nor fire on a given tick. the quiet gears of a block
+    // are advanced at once, and the busy ones turned. a handler can engage, disengage or retune
+    // the gears after it, so the rest of the block is scanned again after a gear with handlers
+    // turns, unless its handlers are deferred. a block with many busy gears is turned gear by
+    // gear instead, as rescanning it would cost more than it saves.
+    while (last - i >= Lanes)
+    {
+        const uint32_t end = i + Lanes;
+        uint32_t busy = scan(&nodes[i]);
+        if (busy == 0)
+        {
+            for (; i < end; i++)
+            {
+                nodes[i].phase = (uint16_t)(nodes[i].phase + nodes[i].step);
+            }
+            continue;
+        }
+
+        uint32_t count = 0;
+        for (uint32_t bits = busy; bits != 0; bits &= bits - 1)
+        {
+            count++;
+        }
+        if (count >= Dense)
+        {
+            while (i < end)
+            {
+                turn(i++);
+            }
+            continue;
+        }
+
+        for (; i < end; i++, busy >>= 1)
+        {
+            Node& node = nodes[i];
+            if ((busy & 1) == 0)
+            {
+                node.phase = (uint16_t)(node.phase + node.step);
+                continue;
+            }
+            bool handlers = node.handled != 0 && !deferred;
+            turn(i);
+            if (handlers)
+            {
+                i++;
+                break;
+            }
+        }
+    }
+    while (i < last)
+    {
+        turn(i++);
+    }
+    return last;
+}
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
 
-Base_Gear::Base_Gear(uint16_t phase, uint16_t step)
-: state(Engaged)
-, ratio(1)
-, step((step > 0) ? step : 1)
-, phase(phase)
-, priority(0)
-, driven(nullptr)
-, next(nullptr)
-{ }
+void Gearbox::tick_instances()
+{
+    // the gears at the same place in every instance are ticked together, Lanes instances at a
+    // time. each block is scanned once, as a handler only changes the gears of its own instance,
+    // and a gear's drive gear, at an earlier place, has already been ticked.
+    const uint32_t n = size();
+    for (uint32_t base = 0; base < n; base += copies)
+    {
+        const uint32_t pinion = parents[base];
+        uint32_t k = 0;
+        for (; copies - k >= Lanes; k += Lanes)
+        {
+            uint32_t first = base + k;
+            uint32_t ticked = 0;
+            if (is_drive(first))
+            {
+                ticked = (1u << Lanes) - 1;
+            }
+            else
+            {
+                for (uint32_t lane = 0; lane < Lanes; lane++)
+                {
+                    ticked |= (uint32_t)(rotated[pinion + k + lane] == clock) << lane;
+                }
+            }
+            if (ticked == 0)
+            {
+                continue;
+            }
+
+            uint32_t busy = scan(&nodes[first]) & ticked;
+            for (uint32_t lane = 0; lane < Lanes; lane++)
+            {
+                if (busy & (1u << lane))
+                {
+                    turn(first + lane);
+                }
+                else if (ticked & (1u << lane))
+                {
+                    Node& node = nodes[first + lane];
+                    node.phase = (uint16_t)(node.phase + node.step);
+                }
+            }
+        }
+        for (; k < copies; k++)
+        {
+            if (is_drive(base + k) || rotated[pinion + k] == clock)
+            {
+                turn(base + k);
+            }
+        }
+    }
+}
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
 
-void Base_Gear::connect(Base_Gear* pinion, uint16_t ratio, uint16_t phase, uint16_t step, uint16_t priority)
+uint32_t Gearbox::scan(const Node* block)
 {
-    this->ratio = ratio;
-    this->phase = phase;
-    this->step = (step > 0) ? step : 1;
-    this->priority = priority;
+    static_assert(offsetof(Node, phase) == 0 && offsetof(Node, step) == 2 &&
+                  offsetof(Node, ratio) == 4 && offsetof(Node, state) == 6 &&
+                  offsetof(Node, handled) == 7, "scan() reads the nodes as 16-bit words");
+
+    // a gear is quiet if it does not rotate, and is disengaged, or engaged without a tick handler.
+    // the first four words of each node are transposed into vectors of phases, steps, ratios, and
+    // states with handled events, and a gear rotates if its phase plus its step, saturated, is at
+    // least its ratio.
+#if defined(__AVX2__)
+    __m256i n[8];
+    for (int k = 0; k < 8; k++)
+    {
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + k));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + k + 8));
+        n[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+    }
+    __m256i a01 = _mm256_unpacklo_epi16(n[0], n[1]);
+    __m256i a23 = _mm256_unpacklo_epi16(n[2], n[3]);
+    __m256i a45 = _mm256_unpacklo_epi16(n[4], n[5]);
+    __m256i a67 = _mm256_unpacklo_epi16(n[6], n[7]);
+    __m256i b03 = _mm256_unpacklo_epi32(a01, a23);
+    __m256i c03 = _mm256_unpackhi_epi32(a01, a23);
+    __m256i b47 = _mm256_unpacklo_epi32(a45, a67);
+    __m256i c47 = _mm256_unpackhi_epi32(a45, a67);
+    __m256i phase = _mm256_unpacklo_epi64(b03, b47);
+    __m256i step = _mm256_unpackhi_epi64(b03, b47);
+    __m256i ratio = _mm256_unpacklo_epi64(c03, c47);
+    __m256i word = _mm256_unpackhi_epi64(c03, c47);
+
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i state = _mm256_set1_epi16(0xFF);
+    const __m256i ticking = _mm256_set1_epi16(0xFF | (Base_Gear::Tick_Event << 8));
+    __m256i sum = _mm256_adds_epu16(phase, step);
+    __m256i rotates = _mm256_cmpeq_epi16(_mm256_subs_epu16(ratio, sum), zero);
+    __m256i engaged = _mm256_cmpeq_epi16(_mm256_and_si256(word, ticking),
+                                         _mm256_set1_epi16(Base_Gear::Engaged));
+    __m256i disengaged = _mm256_cmpeq_epi16(_mm256_and_si256(word, state),
+                                            _mm256_set1_epi16(Base_Gear::Disengaged));
+    __m256i quiet = _mm256_or_si256(engaged, disengaged);
+    __m256i busy = _mm256_or_si256(rotates, _mm256_cmpeq_epi16(quiet, zero));
 
-    if (pinion->driven != nullptr && pinion->driven->priority <= this->priority)
+    // each half holds eight gears, packed to bytes 0 to 7 of it
+    uint32_t bits = (uint32_t)_mm256_movemask_epi8(_mm256_packs_epi16(busy, zero));
+    return (bits & 0xFF) | ((bits >> 8) & 0xFF00);
+#elif defined(__SSE2__)
+    uint32_t mask = 0;
+    for (int half = 0; half < 2; half++)
     {
-        int i = 0;
-        Base_Gear* g = pinion->driven;
-        while (g->next != nullptr && g->next->priority <= this->priority)
+        __m128i n[8];
+        for (int k = 0; k < 8; k++)
         {
-            i++;
-            g = g->next;
+            n[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + half * 8 + k));
         }
-        this->next = g->next;
-        g->next = this;
-        g = pinion->driven;
-        while (g != nullptr)
+        __m128i a01 = _mm_unpacklo_epi16(n[0], n[1]);
+        __m128i a23 = _mm_unpacklo_epi16(n[2], n[3]);
+        __m128i a45 = _mm_unpacklo_epi16(n[4], n[5]);
+        __m128i a67 = _mm_unpacklo_epi16(n[6], n[7]);
+        __m128i b03 = _mm_unpacklo_epi32(a01, a23);
+        __m128i c03 = _mm_unpackhi_epi32(a01, a23);
+        __m128i b47 = _mm_unpacklo_epi32(a45, a67);
+        __m128i c47 = _mm_unpackhi_epi32(a45, a67);
+        __m128i phase = _mm_unpacklo_epi64(b03, b47);
+        __m128i step = _mm_unpackhi_epi64(b03, b47);
+        __m128i ratio = _mm_unpacklo_epi64(c03, c47);
+        __m128i word = _mm_unpackhi_epi64(c03, c47);
+
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i state = _mm_set1_epi16(0xFF);
+        const __m128i ticking = _mm_set1_epi16(0xFF | (Base_Gear::Tick_Event << 8));
+        __m128i sum = _mm_adds_epu16(phase, step);
+        __m128i rotates = _mm_cmpeq_epi16(_mm_subs_epu16(ratio, sum), zero);
+        __m128i engaged = _mm_cmpeq_epi16(_mm_and_si128(word, ticking),
+                                          _mm_set1_epi16(Base_Gear::Engaged));
+        __m128i disengaged = _mm_cmpeq_epi16(_mm_and_si128(word, state),
+                                             _mm_set1_epi16(Base_Gear::Disengaged));
+        __m128i quiet = _mm_or_si128(engaged, disengaged);
+        __m128i busy = _mm_or_si128(rotates, _mm_cmpeq_epi16(quiet, zero));
+
+        mask |= ((uint32_t)_mm_movemask_epi8(_mm_packs_epi16(busy, zero)) & 0xFF) << (half * 8);
+    }
+    return mask;
+#else
+    uint32_t mask = 0;
+    for (uint32_t lane = 0; lane < Lanes; lane++)
+    {
+        const Node& node = block[lane];
+        bool rotates = ((uint32_t)node.phase + node.step >= node.ratio);
+        bool quiet = (node.state == Base_Gear::Disengaged) ||
+                     (node.state == Base_Gear::Engaged && !(node.handled & Base_Gear::Tick_Event));
+        if (rotates || !quiet)
         {
-            g = g->next;
+            mask |= 1u << lane;
         }
     }
-    else
+    return mask;
+#endif
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::unreported(uint32_t i) const
+{
+    // the root of the collapsed subtree is ticked once for every tally of its run since it was
+    // brought up to date, and each gear below it once for every rotation of the gear driving it.
+    // only atomics and what is fixed when the gearbox is compiled are read.
+    uint32_t chain[Max_Collapsed_Height];
+    uint32_t depth = 0;
+    uint32_t root = i;
+    chain[depth++] = root;
+    while (nodes[parents[root]].collapsed)
     {
-        this->next = pinion->driven;
-        pinion->driven = this;
+        root = parents[root];
+        chain[depth++] = root;
+    }
+
+    uint32_t start = nodes[root].skips ? root : folds[root].run;
+    uint64_t ticks = folds[start].tally.load(std::memory_order_relaxed) -
+                     folds[root].based.load(std::memory_order_relaxed);
+    for (uint32_t c = depth; c > 0 && ticks > 0; c--)
+    {
+        uint64_t settled = folds[chain[c - 1]].settled.load(std::memory_order_relaxed);
+        uint64_t phase = settled & 0xFFFF;
+        ticks = wind((settled >> 32) & 0xFFFF, (settled >> 16) & 0xFFFF, phase, ticks);
     }
+
+    // the gear engages on its first rotation, which it counts, and disengages on its first tick
+    Gear_State state = (Gear_State)(folds[i].settled.load(std::memory_order_relaxed) >> 48);
+    return (state == Base_Gear::Engaged || state == Base_Gear::Engaging) ? ticks : 0;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
 
-void Base_Gear::engage(bool engaged)
+void Gearbox::expand(uint32_t i)
 {
-    if (!engaged)
+    uint32_t root = i;
+    while (nodes[parents[root]].collapsed)
     {
-        if (state == Engaged || state == Engaging)
+        root = parents[root];
+    }
+
+    uint32_t start = nodes[root].skips ? root : folds[root].run;
+    uint64_t tally = folds[start].tally.load(std::memory_order_relaxed);
+    uint64_t ticks = tally - folds[root].based.load(std::memory_order_relaxed);
+    if (ticks == 0)
+    {
+        return;
+    }
+
+    // settle() finds when each gear last rotated from the phases of the gears driving it, so
+    // they are brought up to date first. between ticks, snapshot() is told of the change.
+    for (uint32_t p = parents[root]; scheduled && p != 0; p = parents[p])
+    {
+        sync(p);
+    }
+    bool between = (sequence.load(std::memory_order_relaxed) & 1) == 0;
+    if (between)
+    {
+        begin_changes();
+    }
+
+    owed[root] = ticks;
+    settle(root, false);
+    folds[root].based.store(tally, std::memory_order_relaxed);
+    for (uint32_t g = root; g < nodes[root].end; g++)
+    {
+        publish(g);
+    }
+
+    if (between)
+    {
+        end_changes();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::expand_collapsed(uint32_t i)
+{
+    if (folds == nullptr)
+    {
+        return;
+    }
+
+    uint32_t g = i + 1;
+    while (g < nodes[i].end)
+    {
+        if (nodes[g].collapsed)
         {
-            // in the event that on_engaged() was called and it delayed the gear engagement by
-            // one more rotation, the gear will still be in the Engaging state and may require
-            // the corresponding on_disengaged() handler to be called as well.
-            state = Disengaging;
+            expand(g);
+            g = nodes[g].end;
+        }
+        else
+        {
+            g++;
         }
     }
-    else
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::publish(uint32_t i)
+{
+    if (!nodes[i].collapsed)
     {
-        if (state == Disengaged)
+        return;
+    }
+
+    const Node& node = nodes[i];
+    uint64_t settled = (uint64_t)node.phase | ((uint64_t)node.step << 16) |
+                       ((uint64_t)node.ratio << 32) | ((uint64_t)node.state << 48);
+    folds[i].settled.store(settled, std::memory_order_relaxed);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+uint64_t Gearbox::hyperperiod()
+{
+    const uint32_t n = size();
+    if (scheduled)
+    {
+        sync_parked();
+    }
+
+    // over each of its periods, a gear makes a whole number of rotations, which tick the gears it
+    // drives. a driven gear repeats once it has been ticked a multiple of its own period, which
+    // takes the least multiple of its drive gear's period that ticks it that many times.
+    // collapsed gears are only tallied, on the rotations of the gear driving them.
+    std::vector<uint64_t> periods(n);
+    std::vector<uint64_t> rotations(n);
+    uint64_t period = 1;
+    uint32_t i = 0;
+    while (i < n)
+    {
+        const Node& node = nodes[i];
+        if (node.collapsed)
         {
-            state = Engaging;
+            i = node.end;
+            continue;
         }
-        else if (state == Disengaging)
+        if (node.phase >= node.ratio || node.step > node.ratio)
         {
-            // hasn't disengaged yet, so go straight back to engaged
-            state = Engaged;
+            return Never;
         }
+
+        uint64_t divisor = std::gcd<uint64_t>(node.ratio, node.step);
+        uint64_t own = node.ratio / divisor;
+        uint64_t ticks = is_drive(i) ? 1 : rotations[parents[i]];
+        uint64_t multiple = own / std::gcd(own, ticks);
+        uint64_t drive = is_drive(i) ? 1 : periods[parents[i]];
+        if (drive > Never / multiple)
+        {
+            return Never;
+        }
+        periods[i] = drive * multiple;
+        rotations[i] = (ticks * multiple / own) * (node.step / divisor);
+
+        uint64_t common = period / std::gcd(period, periods[i]);
+        if (common > Never / periods[i])
+        {
+            return Never;
+        }
+        period = common * periods[i];
+        i++;
     }
+    return period;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
 
-void Base_Gear::tick()
+bool Gearbox::tabulate(uint32_t limit)
 {
-    if (phase + step >= ratio)
+    const uint32_t n = size();
+
+    // the gears parked by a table are brought up to date before it is removed
+    if (!entries.empty())
     {
-        if (state == Engaging)
+        sync_parked();
+        scheduled = false;
+    }
+    entries.clear();
+    entries.shrink_to_fit();
+    table.clear();
+    table.shrink_to_fit();
+    if (limit == 0 || copies > 1)
+    {
+        return false;
+    }
+
+    uint64_t period = hyperperiod();
+    if (period == Never || period > limit)
+    {
+        return false;
+    }
+
+    // a gear that observes only its rotations is parked, and is listed only on the ticks it
+    // rotates. there is no wheel to keep, so every such gear is parked.
+    std::vector<uint8_t> parks(n, 0);
+    for (uint32_t i = 1; i < n; i++)
+    {
+        uint8_t events = observed_events(i);
+        parks[i] = !nodes[i].collapsed &&
+                   !(events & (Base_Gear::Tick_Event | Base_Gear::Disengaged_Event));
+    }
+
+    // the tree is ticked for a hyperperiod on a copy of the phases, walking it as tick_range()
+    // does, and the events of each gear it ticks are listed
+    std::vector<uint32_t> phases(n);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        phases[i] = nodes[i].phase;
+    }
+
+    std::vector<Record> built;
+    std::vector<uint32_t> starts;
+    starts.reserve(period + 1);
+    uint64_t ticked = 0;
+    for (uint64_t t = 0; t < period; t++)
+    {
+        starts.push_back((uint32_t)built.size());
+        uint32_t i = 0;
+        while (i < n)
         {
-            state = Engaged;
-            on_engaged();
+            if (++ticked > limit)
+            {
+                return false;
+            }
+            if (nodes[i].skips)
+            {
+                built.push_back(Record{ i, 0 });
+                i = folds[i].run;
+                continue;
+            }
+
+            const Node& node = nodes[i];
+            uint32_t phase = phases[i] + node.step;
+            bool rotates = (phase >= node.ratio);
+            phases[i] = rotates ? phase - node.ratio : phase;
+            if (rotates)
+            {
+                built.push_back(Record{ i, Base_Gear::Rotation_Event });
+            }
+            else if (!parks[i])
+            {
+                built.push_back(Record{ i, Base_Gear::Tick_Event });
+            }
+            i = (rotates || !node.drives) ? i + 1 : node.end;
         }
-        if (state == Engaged)
+    }
+    starts.push_back((uint32_t)built.size());
+
+    // every gear is back where it started, or the tree does not repeat as worked out
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (!nodes[i].collapsed && phases[i] != nodes[i].phase)
         {
-            on_tick();
-            on_rotation();
+            return false;
         }
-        if (state == Disengaging)
+    }
+
+    // the gearbox stays scheduled unless it can be tabulated. hyperperiod() brought the gears it
+    // parked up to date.
+    table.swap(built);
+    entries.swap(starts);
+    cycle = 0;
+    this->limit = limit;
+    parked.swap(parks);
+    scheduled = true;
+    park();
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::tick_tabulated()
+{
+    // each event fires as turn() would fire it, with no need to work out whether the gear rotates.
+    // a parked gear is first brought up to date for the ticks it made since it was last listed,
+    // all but the current one, as wake() does. the table is walked by index, as a handler can
+    // retune a gear, which removes it once the tick has finished.
+    for (uint32_t e = entries[cycle]; e < entries[cycle + 1]; e++)
+    {
+        const Record listed = table[e];
+        const uint32_t i = listed.gear;
+        cursor = i;
+        if (listed.event == 0)
         {
-            state = Disengaged;
-            on_disengaged();
+            tally(i);
+            continue;
         }
 
-        phase = (phase + step) - ratio;
+        if (parked[i])
+        {
+            uint32_t p = parents[i];
+            spin(i, turns[p] - synced[i] - 1);
+            synced[i] = turns[p];
+        }
+        if (listed.event == Base_Gear::Rotation_Event)
+        {
+            turn(i, true);
+            turns[i]++;
+            last[i] = clock;
+        }
+        else
+        {
+            turn(i, false);
+        }
+    }
+    cursor = size();
+
+    if (++cycle == entries.size() - 1)
+    {
+        cycle = 0;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox::profile(bool profiled)
+{
+    if (profiled)
+    {
+        costs.assign(size(), Cost{ 0, 0 });
+    }
+    this->profiled = profiled;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Gearbox::Balance Gearbox::balance(uint32_t horizon)
+{
+    const uint32_t n = size();
+    Balance balance = { 0.0, 0.0, 0 };
+
+    // the hyperperiod does not depend on the phases, so the load over it holds after moving them
+    uint64_t period = hyperperiod();
+    balance.ticks = (period < horizon) ? (uint32_t)period : horizon;
+    if (balance.ticks == 0)
+    {
+        return balance;
+    }
 
-        Base_Gear* g = driven;
-        while (g != nullptr)
+    // a gear that was never profiled is taken to be as costly as the average one that was
+    double timed = 0.0;
+    uint32_t profiled_gears = 0;
+    for (const Cost& cost : costs)
+    {
+        if (cost.rotations > 0)
         {
-            g->tick();
-            g = g->next;
+            timed += (double)cost.nanoseconds / cost.rotations;
+            profiled_gears++;
         }
     }
-    else
+    const double untimed = (profiled_gears > 0) ? timed / profiled_gears : 1.0;
+
+    std::vector<double> weights(n, 0.0);
+    std::vector<uint16_t> phases(n);
+    for (uint32_t i = 0; i < n; i++)
     {
-        if (state == Engaged)
+        const Node& node = nodes[i];
+        phases[i] = node.phase;
+        if (!node.collapsed && (gears[i]->observed_events() & Base_Gear::Rotation_Event) &&
+            (node.state == Base_Gear::Engaged || node.state == Base_Gear::Engaging))
         {
-            on_tick();
+            bool timed_gear = !costs.empty() && costs[i].rotations > 0;
+            weights[i] = timed_gear ? (double)costs[i].nanoseconds / costs[i].rotations : untimed;
         }
-        else if (state == Disengaging)
+    }
+
+    std::vector<uint16_t> placed = phases;
+    balance.before = spread(phases, weights, balance.ticks, false);
+    balance.after = spread(placed, weights, balance.ticks, true);
+    if (balance.after >= balance.before)
+    {
+        balance.after = balance.before;
+        return balance;
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        nodes[i].phase = placed[i];
+    }
+    tabulate(0);
+    if (scheduled)
+    {
+        park();
+    }
+    return balance;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+double Gearbox::spread(std::vector<uint16_t>& phases, const std::vector<double>& weights,
+                       uint32_t ticks, bool place) const
+{
+    const uint32_t n = size();
+
+    // a gear is ticked on the rotations of the gear driving it, which are kept, counted in ticks
+    // from now, until the last gear it drives has been placed
+    std::vector<double> load(ticks, 0.0);
+    std::vector<std::vector<uint32_t>> rotations(n);
+    std::vector<uint32_t> waiting(n, 0);
+    for (uint32_t i = copies; i < n; i++)
+    {
+        if (!nodes[i].collapsed)
         {
-            state = Disengaged;
-            on_disengaged();
+            waiting[parents[i]]++;
+        }
+    }
+
+    std::vector<uint32_t> every(ticks);
+    for (uint32_t t = 0; t < ticks; t++)
+    {
+        every[t] = t;
+    }
+
+    std::vector<double> worst;
+    std::vector<uint32_t> turned;
+    uint32_t i = 0;
+    while (i < n)
+    {
+        const Node& node = nodes[i];
+        if (node.collapsed)
+        {
+            i = node.end;
+            continue;
+        }
+
+        const std::vector<uint32_t>& ticked = is_drive(i) ? every : rotations[parents[i]];
+        const uint32_t ratio = node.ratio;
+        const uint32_t step = node.step;
+        if (place && !is_drive(i) && weights[i] > 0.0 && step <= ratio && phases[i] < ratio)
+        {
+            // from phase p, the gear's kth tick rotates it if (p + k * step) % ratio is at least
+            // ratio - step, so the load of that tick counts against 'step' phases in a row
+            worst.assign(ratio, 0.0);
+            uint32_t first = ratio - step;
+            for (uint32_t t : ticked)
+            {
+                uint32_t p = first;
+                for (uint32_t j = 0; j < step; j++)
+                {
+                    worst[p] = std::max(worst[p], load[t]);
+                    p = (p + 1 < ratio) ? p + 1 : 0;
+                }
+                first = (first >= step) ? first - step : first + ratio - step;
+            }
+
+            uint32_t best = phases[i];
+            for (uint32_t p = 0; p < ratio; p++)
+            {
+                if (worst[p] < worst[best])
+                {
+                    best = p;
+                }
+            }
+            phases[i] = (uint16_t)best;
+        }
+
+        // tick the gear as turn() does, from its phase, going straight from one rotation to the
+        // next
+        turned.clear();
+        uint64_t phase = phases[i];
+        size_t k = 0;
+        for (;;)
+        {
+            uint64_t needed = (phase + step >= ratio) ? 1 : (ratio - phase + step - 1) / step;
+            k += needed;
+            if (k > ticked.size())
+            {
+                break;
+            }
+            phase = phase + needed * step - ratio;
+            load[ticked[k - 1]] += weights[i];
+            turned.push_back(ticked[k - 1]);
+        }
+
+        if (waiting[i] > 0)
+        {
+            rotations[i].swap(turned);
+        }
+        if (!is_drive(i) && --waiting[parents[i]] == 0)
+        {
+            std::vector<uint32_t>().swap(rotations[parents[i]]);
+        }
+        i++;
+    }
+
+    double peak = 0.0;
+    for (double l : load)
+    {
+        peak = std::max(peak, l);
+    }
+    return peak;
+}
+
+//-----------------------------------------------------------------------------------------------//
+
+void Gearbox_Builder::connect(Base_Gear* gear, Base_Gear* pinion, uint16_t ratio, uint16_t phase,
+                              uint16_t step, uint16_t priority)
+{
+    // the gear keeps turning as it is until it is built, so it is left alone until then
+    Connection c;
+    c.gear = gear;
+    c.pinion = pinion;
+    c.ratio = (ratio > 0) ? ratio : 1;
+    c.phase = phase;
+    c.step = (step > 0) ? step : 1;
+    c.priority = priority;
+    connections.push_back(c);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Gearbox_Builder::build()
+{
+    // a gear recorded more than once is connected as it was recorded last, as it would be had it
+    // been connected again. the records are ordered by gear, each gear's in the order they were
+    // made, and all but the last of each gear's are dropped. the rest keep the order recorded.
+    std::vector<uint32_t> order(connections.size());
+    for (uint32_t c = 0; c < (uint32_t)order.size(); c++)
+    {
+        order[c] = c;
+    }
+    std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b)
+    {
+        return std::less<Base_Gear*>()(connections[a].gear, connections[b].gear);
+    });
+    std::vector<bool> dropped(connections.size(), false);
+    for (size_t c = 1; c < order.size(); c++)
+    {
+        if (connections[order[c - 1]].gear == connections[order[c]].gear)
+        {
+            dropped[order[c - 1]] = true;
+        }
+    }
+    size_t kept = 0;
+    for (size_t c = 0; c < connections.size(); c++)
+    {
+        if (!dropped[c])
+        {
+            connections[kept++] = connections[c];
+        }
+    }
+    connections.erase(connections.begin() + kept, connections.end());
+
+    for (const Connection& c : connections)
+    {
+        c.gear->disconnect();
+        c.gear->ratio = c.ratio;
+        c.gear->phase = c.phase;
+        c.gear->step = c.step;
+        c.gear->priority = c.priority;
+    }
+
+    // group the gears by drive gear, in ascending priority. the sort is stable, so gears of equal
+    // priority keep the order they were recorded in, as if connected one at a time.
+    std::stable_sort(connections.begin(), connections.end(),
+                     [](const Connection& a, const Connection& b)
+    {
+        if (a.pinion != b.pinion)
+        {
+            return std::less<Base_Gear*>()(a.pinion, b.pinion);
+        }
+        return a.priority < b.priority;
+    });
+
+    size_t first = 0;
+    while (first < connections.size())
+    {
+        Base_Gear* pinion = connections[first].pinion;
+
+        // merge the group into the gears already driven, which are already in priority order. a
+        // gear already connected goes before a new gear of the same priority.
+        Base_Gear* head = nullptr;
+        Base_Gear* last = nullptr;
+        Base_Gear* old = pinion->driven;
+
+        auto append = [&](Base_Gear* g)
+        {
+            g->prev = last;
+            if (last != nullptr)
+            {
+                last->next = g;
+            }
+            else
+            {
+                head = g;
+            }
+            last = g;
+        };
+
+        size_t c = first;
+        while (c < connections.size() && connections[c].pinion == pinion)
+        {
+            Base_Gear* gear = connections[c].gear;
+            while (old != nullptr && old->priority <= gear->priority)
+            {
+                Base_Gear* g = old;
+                old = old->next;
+                append(g);
+            }
+            // as with link(), if the drive gear is ticking its driven gears, this one is passed
+            // over until the next pass
+            gear->pinion = pinion;
+            gear->ticked = pinion->pass;
+            append(gear);
+            c++;
+        }
+        while (old != nullptr)
+        {
+            Base_Gear* g = old;
+            old = old->next;
+            append(g);
         }
+        last->next = nullptr;
+        head->prev = last;
 
-        phase += step;
+        pinion->driven = head;
+        first = c;
     }
+
+    connections.clear();
 }
 
 //-----------------------------------------------------------------------------------------------//
 
+#ifndef GEARBOX_NO_MAIN
+
 class User_Class
 {
 public:
@@ -182,3 +2675,5 @@ int main(int argc, char** argv)
 
     return 0;
 }
+
+#endif // GEARBOX_NO_MAIN //
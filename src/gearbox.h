@@ -9,7 +9,16 @@
 #ifndef _WELLWOOD_GEARBOX_H_
 #define _WELLWOOD_GEARBOX_H_
 
+#include "timing_wheel.h"
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <vector>
+
+class Command_Queue;
+class Gearbox;
+class Handler_Pool;
+class Work_Pool;
 
 /*
  * Gearbox is a tree of connected gears, with the drive gear (at the root) ticking all other gears
@@ -35,17 +44,47 @@ public:
      * already elapsed. Phase is pre-incremented, so if phase starts at 0, the first tick() will
      * see a phase of 1. 'step' is the phase increment per tick (1 to 'ratio'): Fractional gear
      * ratios can be produced with a step greater than 1. 'priority' ranks the gear in the tick
-     * sequence of all gears directly driven by 'pinion', lowest number first.
+     * sequence of all gears directly driven by 'pinion', lowest number first, and after any gears
+     * of the same priority already connected.
+     *
+     * A gear already connected is disconnected first. Connecting takes constant time when the gear
+     * has the highest priority of those driven by 'pinion' (as it always does when they all have
+     * the same priority), otherwise it is linear in the number of gears of higher priority.
      */
     void connect(Base_Gear* pinion, uint16_t ratio, uint16_t phase = 0, uint16_t step = 1, uint16_t priority = 0);
 
+    /*
+     * Disconnects this gear from its drive gear, in constant time. The gear keeps its phase,
+     * state and the gears it drives. Does nothing if the gear is not connected.
+     *
+     * Gears can be connected, disconnected and reconnected from handlers while the tree is
+     * ticking. A gear disconnected before its drive gear has ticked it is not ticked, and a gear
+     * connected while its new drive gear is ticking the gears it drives is first ticked on the
+     * drive gear's next rotation.
+     *
+     * Neither this gear nor 'pinion' may be compiled into a Gearbox when it is connected or
+     * disconnected.
+     */
+    void disconnect();
+
+    /*
+     * Connects this gear to drive gear 'pinion' with its current ratio, phase, step and priority,
+     * disconnecting it from its current drive gear first, as by connect().
+     */
+    void reconnect(Base_Gear* pinion) { connect(pinion, ratio, phase, step, priority); }
+
+    /*
+     * Returns the gear driving this one, or null if it is not connected.
+     */
+    Base_Gear* get_pinion() const { return pinion; }
+
     /*
      * This is a special purpose method to allow the engagement of a gear to be delayed for more
      * than one rotation.
      *
      * This may only be called from an on_engaged() handler, otherwise the behavior undefined.
      */
-    void delay_engagement() { if (state == Engaged) state = Engaging; }
+    void delay_engagement() { if (current_state() == Engaged) current_state() = Engaging; }
 
     /*
      * Begins engaging or disengaging this gear. Gears are initially are engaged by default. A
@@ -54,30 +93,33 @@ public:
      *
      * A gear is still ticked and it still drives connected gears while it is not engaged, but its
      * tick and rotation events are suppressed.
+     *
+     * Only the thread ticking the gear may call this. Other threads can queue the request with a
+     * Command_Queue instead.
      */
     void engage(bool engaged);
 
     /*
      * Returns true when the gear is fully disengaged.
      */
-    bool is_disengaged() const { return state == Disengaged; }
+    bool is_disengaged() const { return current_state() == Disengaged; }
 
     /*
      * Returns true when the gear is fully engaged.
      */
-    bool is_engaged() const { return state == Engaged; }
+    bool is_engaged() const { return current_state() == Engaged; }
 
     /*
      * Returns true if the gear is in the process of engaging but has not yet fully engaged.
      */
-    bool is_engaging() const { return state == Engaging; }
+    bool is_engaging() const { return current_state() == Engaging; }
 
     /*
      * Returns the current phase of rotation. Typically is 1 to ratio, but if the gear has a
      * fractional ratio (step > 1), its phase can be as much as ratio + step at the end of a
      * rotation.
      */
-    uint16_t get_phase() const { return phase; }
+    uint16_t get_phase() const;
 
     /*
      * Returns the gear's ratio that was configured when it was connected to its drive gear.
@@ -90,10 +132,51 @@ public:
     uint16_t get_step() const { return step; }
 
     /*
-     * Ticks the gear, updating its phase.
+     * Return the gear's timestamps, in ticks of the drive gear of its Gearbox, numbered from 1
+     * for the first tick after the gearbox was created (see Gearbox::now()). get_tick() returns
+     * the tick in progress, or between ticks, the last one. get_last_rotation() returns the tick
+     * on which the gear last rotated, the one in progress included, or 0 if it has not rotated
+     * since the gearbox was created. get_next_rotation() returns the first tick after the one in
+     * progress on which it will rotate, or Gearbox::Never, as things stand: retuning it or a gear
+     * driving it changes it. The tick and last rotation are kept as the gearbox ticks, and take
+     * constant time; the next rotation is found from the ratio, step and phase of each gear
+     * driving this one.
+     *
+     * A gear that has not been compiled into a Gearbox has no clock, and each returns 0. In a
+     * gearbox ticked in parallel, they may only be called between ticks. A counter collapsed by
+     * its gearbox is brought up to date first, which takes time in the size of its subtree.
+     */
+    uint64_t get_tick() const;
+
+    uint64_t get_last_rotation() const;
+
+    uint64_t get_next_rotation() const;
+
+    /*
+     * Changes the gear's ratio and step, as if it had been connected with them, keeping its phase.
+     * A gear whose phase has reached its new ratio rotates on its next tick.
+     *
+     * Only the thread ticking the gear may call this. Other threads can queue the request with a
+     * Command_Queue instead.
+     */
+    void retune(uint16_t ratio, uint16_t step = 1);
+
+    /*
+     * Ticks the gear, updating its phase, and on rotation, the gears it drives. The tree is walked
+     * with an explicit stack rather than by recursion, so its depth is not limited by the native
+     * stack.
+     *
+     * A gear that has been compiled into a Gearbox must be ticked through the Gearbox instead.
      */
     void tick();
 
+    /*
+     * Returns the rotations the gear has made while engaged that have yet to be reported with
+     * on_rotation() or on_rotations(), which is only ever the case for a counter collapsed by its
+     * Gearbox. May be called from any thread.
+     */
+    uint64_t get_unreported_rotations() const;
+
 protected:
 
     Base_Gear(uint16_t phase, uint16_t step);
@@ -126,22 +209,92 @@ protected:
      */
     virtual void on_disengaged() { }
 
-    enum Gear_State { Disengaged, Engaging, Engaged, Disengaging };
+    enum Gear_Event : uint8_t
+    {
+        Engaged_Event    = 0x01,
+        Tick_Event       = 0x02,
+        Rotation_Event   = 0x04,
+        Disengaged_Event = 0x08,
+        All_Events       = 0x0F
+    };
+
+    /*
+     * Sets the events (Gear_Event flags) the gear handles. The handler of an event that is not
+     * handled (on_engaged(), on_tick(), on_rotation() or on_disengaged()) is not called, so ticking
+     * a gear costs nothing beyond updating its phase for the events nobody listens to. All events
+     * are handled by default. A Gearbox observes events the gear comes to handle from the gear it
+     * ticks next, and a scheduled one stops parking the gear from its next tick if need be.
+     */
+    void set_handled_events(uint8_t events);
+
+    /*
+     * Returns the events (Gear_Event flags) the gear handles.
+     */
+    uint8_t get_handled_events() const;
+
+    /*
+     * Returns the events (Gear_Event flags) that have an effect outside of the gear itself, other
+     * than counting rotations, which by default are those it handles. Gearbox::advance()
+     * fast-forwards gears in closed form while none of their observed events can fire: instead of
+     * firing their events one tick at a time, it reports the rotations they made while engaged
+     * with a single call to on_rotations().
+     */
+    virtual uint8_t observed_events() const { return get_handled_events(); }
+
+    /*
+     * Called by Gearbox::advance() in place of 'rotations' calls to on_tick() and on_rotation(),
+     * while none of the gear's observed events can fire.
+     */
+    virtual void on_rotations(uint64_t rotations) { (void)rotations; }
+
+    enum Gear_State : uint8_t { Disengaged, Engaging, Engaged, Disengaging };
 
     Gear_State state;               // gear's action is triggered each rotation when it is engaged
 
 private:
 
+    friend class Gearbox;
+    friend class Gearbox_Builder;
+    friend class Handler_Pool;
+
     Base_Gear(const Base_Gear& other) = delete;
     Base_Gear& operator=(const Base_Gear&) = delete;
 
+    /*
+     * Returns the gear's state, which is held by its Gearbox while the gear is compiled into one.
+     */
+    Gear_State current_state() const;
+    Gear_State& current_state();
+
+    uint8_t handled;                // events whose handlers are called (Gear_Event flags)
+    uint8_t pass;                   // parity of the rotations on which this ticks driven gears
+    uint8_t ticked;                 // pass of the drive gear on which this was last ticked
+
     uint16_t ratio;                 // number of drive gear rotations to one rotation of this
     uint16_t step;                  // number of steps phase change per rotation of the drive gear
     uint16_t phase;                 // current phase (1..ratio)
     uint16_t priority;              // order among siblings (ticked by priority in ascending order)
+    uint32_t node;                  // index of this gear in its gearbox
+
+    /*
+     * Links this gear into the gears driven by 'pinion', after the last one of equal or lower
+     * priority.
+     */
+    void link(Base_Gear* pinion);
+
+    /*
+     * Ticks this gear alone, firing its events, and returns true if it rotated, in which case it
+     * is ready to tick the gears it drives.
+     */
+    bool turn();
 
     Base_Gear* driven;              // linked listed of gears being driven by this
     Base_Gear* next;                // next sibling gear
+    Base_Gear* prev;                // previous sibling gear, or the last one if this is the first
+    Base_Gear* pinion;              // gear driving this one, or null if it is not connected
+    Base_Gear* cursor;              // driven gear last ticked by tick(), or null if none yet
+
+    Gearbox* gearbox;               // gearbox holding the phase and state while compiled, or null
 };
 
 //-----------------------------------------------------------------------------------------------//
@@ -157,6 +310,8 @@ public:
 
     typedef void (T::*Handler)();
 
+    typedef void (T::*Rotations_Handler)(uint64_t rotations);
+
     /*
      * Creates a new gear that will notify 'observer' of its events. 'observer' cannot be null and
      * its lifetime must extend beyond the gear's.
@@ -167,7 +322,7 @@ public:
     explicit Gear(T* observer)
     : Base_Gear(0, 1)
     , observer(observer)
-    { }
+    { set_handled_events(0); }
 
     /*
      * Creates a new main drive gear (not driven by another), that will notify 'observer' of its
@@ -176,33 +331,89 @@ public:
     explicit Gear(T* observer, uint16_t phase, uint16_t step)
     : Base_Gear(phase, step)
     , observer(observer)
-    { }
+    { set_handled_events(0); }
 
-    void handle_engaged(Handler handler) { engaged_handler = handler; }
+    void handle_engaged(Handler handler) { handle(&Handlers::engaged, Engaged_Event, handler); }
     
-    void handle_disengaged(Handler handler) { disengaged_handler = handler; }
+    void handle_disengaged(Handler handler)
+    { handle(&Handlers::disengaged, Disengaged_Event, handler); }
     
-    void handle_tick(Handler handler) { tick_handler = handler; }
+    void handle_tick(Handler handler) { handle(&Handlers::tick, Tick_Event, handler); }
 
-    void handle_rotation(Handler handler) { rotation_handler = handler; }
+    void handle_rotation(Handler handler) { handle(&Handlers::rotation, Rotation_Event, handler); }
+
+    /*
+     * Sets a handler notified of the gear's rotations in batches. Ticking the gear reports each
+     * rotation with a call for 1, but Gearbox::advance() fast-forwards the gear as it does a
+     * Counter, and reports all the rotations it makes between other events with a single call,
+     * so catching up on many missed ticks costs one call rather than one per rotation. A gear
+     * that also handles single rotations with handle_rotation() reports each rotation to both.
+     */
+    void handle_rotations(Rotations_Handler handler)
+    { handle(&Handlers::rotations, Rotation_Event, handler); }
 
 protected:
 
-    virtual void on_engaged() override { if (engaged_handler) (observer->*engaged_handler)(); }
+    virtual void on_engaged() override
+    { if (handlers && handlers->engaged) (observer->*handlers->engaged)(); }
 
-    virtual void on_disengaged() override { if (disengaged_handler) (observer->*disengaged_handler)(); }
+    virtual void on_disengaged() override
+    { if (handlers && handlers->disengaged) (observer->*handlers->disengaged)(); }
 
-    virtual void on_tick() override { if (tick_handler) (observer->*tick_handler)(); }
+    virtual void on_tick() override
+    { if (handlers && handlers->tick) (observer->*handlers->tick)(); }
 
-    virtual void on_rotation() override { if (rotation_handler) (observer->*rotation_handler)(); }
+    virtual void on_rotation() override
+    {
+        if (handlers && handlers->rotation) (observer->*handlers->rotation)();
+        if (handlers && handlers->rotations) (observer->*handlers->rotations)(1);
+    }
+
+    virtual uint8_t observed_events() const override
+    {
+        // rotations handled only in batches are counted, like a Counter's
+        uint8_t events = get_handled_events();
+        if (handlers && handlers->rotations && !handlers->rotation) events &= ~Rotation_Event;
+        return events;
+    }
+
+    virtual void on_rotations(uint64_t rotations) override
+    { if (handlers && handlers->rotations) (observer->*handlers->rotations)(rotations); }
 
 private:
 
-    T*      observer;
-    Handler engaged_handler    = nullptr;
-    Handler disengaged_handler = nullptr;
-    Handler tick_handler       = nullptr;
-    Handler rotation_handler   = nullptr;
+    /*
+     * The handlers are only read when an event fires, and most gears handle few events or none, so
+     * they are kept out of the gear, which stays small enough to share a cache line with the next.
+     */
+    struct Handlers
+    {
+        Handler engaged    = nullptr;
+        Handler disengaged = nullptr;
+        Handler tick       = nullptr;
+        Handler rotation   = nullptr;
+
+        Rotations_Handler rotations = nullptr;
+    };
+
+    template <class H>
+    void handle(H Handlers::* slot, uint8_t event, H handler)
+    {
+        if (handler && !handlers) handlers.reset(new Handlers());
+        if (handlers) (*handlers).*slot = handler;
+
+        // single and batched rotations are both rotation events
+        bool handled = handlers && (*handlers).*slot;
+        if (handlers && event == Rotation_Event)
+        {
+            handled = handlers->rotation || handlers->rotations;
+        }
+        uint8_t events = get_handled_events();
+        set_handled_events(handled ? (events | event) : (events & ~event));
+    }
+
+    T* observer;
+    std::unique_ptr<Handlers> handlers;     // allocated by the first handler registered
 };
 
 //-----------------------------------------------------------------------------------------------//
@@ -218,20 +429,886 @@ public:
     Counter(uint16_t phase = 0, uint16_t step = 1)
     : Base_Gear(phase, step)
     , total(0ULL)
-    { }
+    { set_handled_events(Rotation_Event); }
 
     /*
-     * Returns the total number of gear rotations.
+     * Returns the total number of gear rotations. May be called from any thread, though only
+     * Gearbox::snapshot() reads several counters as of the same tick. The count of a counter
+     * collapsed by its Gearbox is worked out from the rotations of the gear driving it, so read
+     * by another thread while the counter or one driving it is engaged, disengaged or retuned, or
+     * while the gearbox advances, it can be off by the rotations since it was last brought up to
+     * date, though not when read by snapshot().
      */
-    uint64_t count() const { return total; }
+    uint64_t count() const
+    {
+        return total.load(std::memory_order_relaxed) + get_unreported_rotations();
+    }
 
 protected:
 
-    virtual void on_rotation() override { total +=1; }
+    virtual void on_rotation() override { add(1); }
+
+    virtual uint8_t observed_events() const override { return 0; }
+
+    virtual void on_rotations(uint64_t rotations) override { add(rotations); }
 
 private:
 
-    uint64_t total;
+    // only the ticking thread writes the total, so it is updated with plain loads and stores
+    void add(uint64_t rotations)
+    {
+        total.store(total.load(std::memory_order_relaxed) + rotations, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> total;
 };
 
+//-----------------------------------------------------------------------------------------------//
+
+/*
+ * Gearbox is a compiled form of a gear tree. The tree is laid out, starting from its drive gear,
+ * in a flat array in tick order (pre-order), holding the ratio, step, phase and state of every
+ * gear in a 16-byte node. Each node also records the end of the range of gears the gear drives, so
+ * a tick is a single loop over the array: a gear that rotates continues into the gears it drives,
+ * and a gear that does not rotate skips past them. Gears are ticked in exactly the same order,
+ * and their events are fired in exactly the same order, as by Base_Gear::tick().
+ *
+ * While a gear is compiled into a Gearbox, the gearbox holds its phase and state. The gear's
+ * accessors and engage() read and write them there, and they are written back to the gears when
+ * the gearbox is destroyed. Gears must not be connected to the tree while it is compiled, and a
+ * gear may only be compiled into one gearbox at a time.
+ *
+ * A gearbox can also be scheduled, which parks gears that only observe their rotations in a
+ * timing wheel, keyed by the tick of the drive gear on which each will next rotate. tick() then
+ * visits a parked gear, and the gears it drives, only on the ticks it rotates, so the time taken
+ * by a tick follows the number of gears rotating rather than the size of the tree.
+ *
+ * Subtrees made only of Counters (and not of classes derived from Counter), such as statistics
+ * counters, are collapsed when the tree is compiled, up to eight gears deep. They fire no events
+ * but for counting, so rather than ticking them, a tick tallies the rotations of the gear driving
+ * each run of them, and a collapsed counter's count, phase and state are worked out from the
+ * tally when they are read. Collapsed counters thus cost a tick next to nothing, however many
+ * there are.
+ *
+ * A gearbox can also tick many instances of the same tree together, such as a tree per entity
+ * or per connection. Their gears are laid out by place in the tree rather than by instance, so
+ * the gears at the same place in a block of instances are scanned for events at once, and each
+ * instance still fires its events in the order it would alone.
+ */
+class Gearbox
+{
+public:
+
+    /*
+     * Compiles the tree of gears driven by 'drive', including 'drive' itself. 'drive' cannot be
+     * null and its lifetime, and that of every gear it drives, must extend beyond the gearbox's.
+     */
+    explicit Gearbox(Base_Gear* drive);
+
+    /*
+     * Compiles the trees of gears driven by each of 'drives', as instances ticked together by
+     * tick(). 'drives' cannot be empty, and every tree must have the same shape: each gear must
+     * drive as many gears as the gear at the same place in the first tree, with the same ratio
+     * and step, or std::invalid_argument is thrown. The lifetimes of the gears are as for a
+     * single tree. Each instance ticks, rotates and fires its events as it would in a gearbox of
+     * its own, provided a handler engages, disengages or retunes only gears of its own instance.
+     *
+     * The counters of the trees are not collapsed, the gearbox cannot be scheduled, tabulated or
+     * parallelized, and advance() makes its ticks one at a time.
+     */
+    explicit Gearbox(const std::vector<Base_Gear*>& drives);
+
+    ~Gearbox();
+
+    /*
+     * Ticks the drive gear, and through it the whole tree.
+     */
+    void tick();
+
+    /*
+     * Advances the drive gear by 'ticks' ticks, with the same result as calling tick() that many
+     * times. The ticks between events are advanced in closed form from each gear's ratio, step and
+     * phase (see Base_Gear::observed_events()), so the time taken is proportional to the size of
+     * the tree and the number of ticks that fire events, regardless of 'ticks'. Subtrees without
+     * observed events are only brought up to date before each event, so handlers see the tree as
+     * it would be after the same sequence of ticks.
+     *
+     * Handlers registered during the advance, and coroutines that begin waiting on a gear, take
+     * effect from the gear ticked next, as they would with tick().
+     */
+    void advance(uint64_t ticks);
+
+    static const uint64_t Never = UINT64_MAX;
+
+    /*
+     * Returns the number of ticks of the drive gear until the next tick that fires an observed
+     * event of any gear (1 if the next tick does), or Never if none can fire. It is computed from
+     * the ratio, step, phase and state of each gear, so it holds until a gear is engaged or
+     * disengaged, which can only happen in a handler or between ticks. The ticks before it can be
+     * skipped with advance().
+     */
+    uint64_t next_event();
+
+    /*
+     * Schedules or unschedules the gearbox. While it is scheduled, each gear other than the drive
+     * gear that observes neither its ticks nor its disengagement (see
+     * Base_Gear::observed_events()), and that makes at least four ticks per rotation, is parked in
+     * a timing wheel until the tick on which it will rotate.
+     *
+     * A parked gear's phase and state are not updated as it ticks. They are derived from the
+     * rotations its drive gear has made since, when it rotates, when it is engaged, disengaged or
+     * retuned, and when they are read with get_phase() or is_engaged() and the like, which see the
+     * same values as they would if the gear had been ticked. Its events and those of every other
+     * gear are unaffected. advance() and next_event() bring parked gears up to date first.
+     * Scheduling again re-parks the gears, for example after handlers have been registered. A gear
+     * retuned by a handler while the gearbox is scheduled takes its new ratio and step from the
+     * next tick.
+     */
+    void schedule(bool scheduled);
+
+    /*
+     * Returns true if the gearbox is scheduled.
+     */
+    bool is_scheduled() const { return scheduled && entries.empty(); }
+
+    /*
+     * Returns the hyperperiod of the tree: the number of ticks of the drive gear after which the
+     * phases of the gears it ticks, and so the ticks on which each gear is ticked and rotates,
+     * repeat. A gear ticked every tick repeats every ratio / gcd(ratio, step) of its own ticks,
+     * so the hyperperiod is the least common multiple of those periods, counted in ticks of the
+     * drive gear. Returns Never if it does not fit in 64 bits, or if a gear has yet to settle into
+     * a repeating pattern, having a phase or step greater than its ratio. Collapsed counters are
+     * not ticked, only tallied on the rotations of the gears driving them, so their periods are
+     * left out, and their phases need not repeat over the hyperperiod.
+     */
+    uint64_t hyperperiod();
+
+    /*
+     * Compiles a table of the events on each tick of the hyperperiod, in tick order, if the tree
+     * makes no more than 'limit' ticks of gears over it in all, and returns true. Otherwise, or if
+     * 'limit' is 0, removes the table, and returns false. While the gearbox has a table, tick()
+     * fires the events listed for the current tick rather than walking the tree, so it neither
+     * visits the gears that do nothing on the tick nor works out which gears rotate.
+     *
+     * The table lists each rotation of every gear, and the other ticks of the gears that observe
+     * them. As in a scheduled gearbox, the gears that only observe their rotations are parked:
+     * they are brought up to date when they rotate, and when they are read, which sees the same
+     * values as if they had been ticked.
+     *
+     * Engaging and disengaging gears leave the table as it is. A parked gear that comes to handle
+     * its ticks is listed on them from the next tick, the table being compiled again, and removed
+     * if it then makes too many. Retuning a gear removes the table, and a gear retuned by a handler
+     * takes its new ratio and step as the tick finishes. Scheduling the gearbox removes the table,
+     * and compiling one unschedules it, though a gearbox that cannot be tabulated is left
+     * scheduled. The pool set by parallelize() is not used while the gearbox has a table.
+     */
+    bool tabulate(uint32_t limit);
+
+    /*
+     * Returns true if the gearbox has a table of the ticks of its hyperperiod.
+     */
+    bool is_tabulated() const { return !entries.empty(); }
+
+    /*
+     * Starts or stops deferring the handlers of the gears' events. While events are deferred, a
+     * tick first updates the phases and states of the gears, recording each event in a buffer
+     * kept from tick to tick rather than calling its handler, and then calls the handlers of the
+     * events recorded, in the order they would otherwise have been called. The walk of the tree
+     * is not interrupted by the handlers, and they do not evict it from the cache.
+     *
+     * The handlers see the tree as it is at the end of the tick, and the gears they engage,
+     * disengage or retune change as though between ticks, from the next tick on. The events fired
+     * are the same as when they are not deferred, unless a handler changes a gear that has yet to
+     * be ticked on the same tick. advance() calls the handlers of each tick that fires events
+     * before looking for the next. The pool set by parallelize() is not used while events are
+     * deferred.
+     */
+    void defer(bool deferred);
+
+    /*
+     * Returns true if the handlers of events are deferred to the end of each tick.
+     */
+    bool is_deferred() const { return deferred; }
+
+    /*
+     * Starts or stops timing the rotation handlers of the gears. While the gearbox is profiled,
+     * each call it makes to a gear's on_rotation() is timed, for balance(). Starting clears the
+     * times taken before, and stopping keeps them.
+     */
+    void profile(bool profiled);
+
+    /*
+     * The load of the heaviest tick of the drive gear among those balance() looked ahead at,
+     * before and after it moved the gears.
+     */
+    struct Balance
+    {
+        double   before;    // in nanoseconds if any rotation handler was profiled, else in calls
+        double   after;
+        uint32_t ticks;     // ticks looked ahead
+    };
+
+    /*
+     * Moves the phases of the gears to spread the calls to their rotation handlers over the ticks
+     * of the drive gear, so that gears connected with the same ratio and phase no longer all
+     * rotate on the same tick, and returns the load of the heaviest tick before and after.
+     *
+     * The load is worked out for the next 'horizon' ticks, or for the hyperperiod if it is shorter,
+     * in which case it holds for every tick after. Each rotation of an engaged or engaging gear
+     * that observes its rotations (see Base_Gear::observed_events()), as a counter does not,
+     * weighs the mean time its handler took while profiled (see profile()), or the mean of the
+     * profiled gears if it was not profiled, or 1 if none were. The gears are placed one at a time
+     * in tick order, each at the phase that keeps the heaviest tick lightest given the gears placed
+     * before it, carrying the gears it drives with it. If that finds nothing lighter than the
+     * phases as they are, they are left as they are. The drive gear, and gears that observe no
+     * rotations or have a step greater than their ratio, keep their phases.
+     *
+     * A gear moved to another phase rotates on the ticks it would have, had it been connected with
+     * that phase. The time taken is in the number of ticks looked ahead times the number of gears
+     * ticked on them, plus the sum of the ratios of the gears moved. May only be called between
+     * ticks. The table of a tabulated gearbox is removed, and the gears of a scheduled one are
+     * parked again.
+     */
+    Balance balance(uint32_t horizon = 4096);
+
+    /*
+     * Ticks the subtrees of the gears driven by the drive gear in parallel on 'pool', or all on
+     * the calling thread again if 'pool' is null. tick() ticks the drive gear on the calling
+     * thread and, if it rotates, hands its subtrees to the pool in groups of at least 'grain'
+     * gears, returning once every group has been ticked.
+     *
+     * Within a subtree, gears are ticked and their events fired in the same order as on one
+     * thread, but the events of different subtrees fire concurrently and in no particular order.
+     * The handlers of a subtree may only engage or disengage its own gears, and must synchronize
+     * any data they share with the handlers of another. The pool is not used while the gearbox is
+     * scheduled, while any gear is offloaded (see offload()), nor by advance(), and its lifetime
+     * must extend beyond its use by the gearbox.
+     */
+    void parallelize(Work_Pool* pool, uint32_t grain = 1024);
+
+    /*
+     * Sets the queue of requests from other threads to engage, disengage and retune the gears,
+     * which is drained at the start of each tick() and advance(), or clears it if 'commands' is
+     * null. Its lifetime must extend beyond its use by the gearbox.
+     */
+    void set_commands(Command_Queue* commands) { this->commands = commands; }
+
+    /*
+     * Has the handlers of 'gear' called on the worker threads of 'pool', or on the ticking thread
+     * again if 'pool' is null. 'gear' must be one of the gearbox's.
+     * An offloaded event costs the tick only the posting of it to a ring, whatever its handler
+     * does, and if the ring is full it is dropped (see Handler_Pool). The events still fire on
+     * the same ticks, in the same order for each gear, and the gear's state changes with them on
+     * the ticking thread, but its handlers may not touch the gears (see Handler_Pool). Offloaded
+     * rotations are not timed by profile(), and advance() ticks an offloaded gear one event at a
+     * time rather than reporting its rotations with on_rotations(). A counter collapsed by the
+     * gearbox fires no events, and is counted on the ticking thread. Each ring of a pool is
+     * filled by one thread, so the pool set by parallelize() is not used while any gear is
+     * offloaded. The lifetime of 'pool' must extend beyond its use by the gearbox.
+     */
+    void offload(Base_Gear* gear, Handler_Pool* pool);
+
+    /*
+     * Copies the count of each of 'counters' to 'counts', as they all stood between the same two
+     * ticks, and returns the number of ticks of the drive gear made before then, as now() would
+     * have, counting each tick made by advance(). May be called from any thread while the gearbox
+     * is ticked, without holding up the ticking thread: the copy is retried if a tick() or
+     * advance() runs while it is made, so a snapshot waits out the tick in progress. The counters
+     * must be gears of the gearbox.
+     */
+    uint64_t snapshot(const std::vector<const Counter*>& counters,
+                      std::vector<uint64_t>& counts) const;
+
+    /*
+     * Returns the number of gears in the gearbox, including the drive gear of each instance.
+     */
+    uint32_t size() const { return (uint32_t)gears.size(); }
+
+    /*
+     * Returns the number of instances of the tree ticked together, 1 for a single tree.
+     */
+    uint32_t instances() const { return copies; }
+
+    /*
+     * Returns the number of ticks of the drive gear since the gearbox was created, counting the
+     * tick in progress, whether made by tick() or advance(). The clock takes 64 bits, so it does
+     * not wrap.
+     */
+    uint64_t now() const { return clock; }
+
+private:
+
+    friend class Base_Gear;
+
+    Gearbox(const Gearbox& other) = delete;
+    Gearbox& operator=(const Gearbox&) = delete;
+
+    typedef Base_Gear::Gear_State Gear_State;
+
+    /*
+     * How the ticks of a gear being settled are counted back: its tick 'ago' ticks before its
+     * latest is the tick 'base' + 'ago' * 'scale' ticks before the latest of 'anchor' if that is
+     * a drive gear, and otherwise the rotation that many rotations before the latest of the gear
+     * driving 'anchor'.
+     */
+    struct Frame
+    {
+        uint64_t base;
+        uint64_t scale;
+        uint32_t anchor;
+    };
+
+    /*
+     * Ticks gear 'i', firing its events, and returns true if it rotated.
+     */
+    bool turn(uint32_t i);
+
+    /*
+     * As turn(), for a gear known to rotate on the tick if 'rotates' is true, or not to otherwise.
+     */
+    bool turn(uint32_t i, bool rotates);
+
+    /*
+     * Mark the start and end of a change to the gears, such as a tick() or advance(), for
+     * snapshot(), which the end publishes the clock to. The sequence is odd while the gears are
+     * changing, and it and the published clock are only written by the ticking thread, so plain
+     * stores suffice.
+     */
+    void begin_changes()
+    {
+        sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void end_changes()
+    {
+        completed.store(clock, std::memory_order_relaxed);
+        sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /*
+     * Fires the events of gear 'i' for a tick, and makes its changes of state, before its phase
+     * is updated.
+     */
+    void fire(uint32_t i, bool rotates);
+
+    /*
+     * Calls the handler of event 'Event' (a Gear_Event) of gear 'i', or records the event if
+     * events are deferred.
+     */
+    template <uint8_t Event>
+    void call(uint32_t i);
+
+    /*
+     * Calls the handler of event 'Event' of gear 'i'.
+     */
+    template <uint8_t Event>
+    void invoke(uint32_t i);
+
+    /*
+     * Calls the handlers of the events recorded during the tick just made, in order.
+     */
+    void dispatch();
+
+    /*
+     * Ticks the gears from 'first' up to 'last', which must be whole subtrees, as by tick().
+     */
+    void tick_range(uint32_t first, uint32_t last);
+
+    /*
+     * Ticks group of subtrees 'group' of 'gearbox' for parallelize(), as a Work_Pool job.
+     */
+    static void tick_group(void* gearbox, uint32_t group);
+
+    /*
+     * Returns the events of gear 'i' that advance() cannot fast-forward: those it observes, or
+     * every event it handles if its handlers are offloaded.
+     */
+    uint8_t observed_events(uint32_t i) const;
+
+    /*
+     * Updates which gears have observed events, or drive gears that have them.
+     */
+    void observe();
+
+    /*
+     * Notes that gear 'i' has come to handle 'events' it did not, so advance() observes it from
+     * the gear it is ticking on, and a scheduled gearbox stops parking it from the next tick.
+     */
+    void handle_more(uint32_t i, uint8_t events);
+
+    /*
+     * Returns next_event(), for the observed gears last found by observe().
+     */
+    uint64_t horizon();
+
+    /*
+     * Returns the number of ticks gear 'i' needs to make 'rotations' rotations, or Never.
+     */
+    uint64_t ticks_to_rotate(uint32_t i, uint64_t rotations) const;
+
+    uint64_t ticks_to_rotate(uint32_t i, uint64_t phase, uint64_t rotations) const;
+
+    /*
+     * Returns the tick of the drive gear on which gear 'i' makes its 'ticks'th tick, or Never.
+     */
+    uint64_t tick_time(uint32_t i, uint64_t ticks) const;
+
+    /*
+     * Ticks the observed gears, and those that drive them, counting the ticks owed to each
+     * unobserved gear they drive instead of ticking it.
+     */
+    void tick_observed();
+
+    /*
+     * Returns the tick on which gear 'i' made the tick 'ago' ticks before its latest, counted
+     * back through the frames of the gears driving it, or 0 if it came before the gearbox was
+     * created. The frame of 'i' and of each gear it is counted back through must be current.
+     */
+    uint64_t tick_of(uint32_t i, uint64_t ago) const;
+
+    /*
+     * Finds the frame of gear 'first', and of each gear driving it that its ticks are counted
+     * back through, from the ratios, steps and phases of the gears driving it. The gears after
+     * 'first' in its subtree are taken to be up to date with it.
+     */
+    void frame_drivers(uint32_t first);
+
+    /*
+     * Finds the frame of gear 'i' from that of its drive gear, which is up to date with it.
+     */
+    void frame(uint32_t i);
+
+    /*
+     * Turns 'frame', which counts back to rotations of gear 'p', into one that counts back to
+     * ticks of 'p'. Returns false, leaving it unchanged, if the ticks between the rotations of
+     * 'p' are uneven.
+     */
+    bool carry(uint32_t p, Frame& frame) const;
+
+    /*
+     * Returns the first tick after the one in progress on which gear 'i' rotates, or Never.
+     */
+    uint64_t next_rotation(uint32_t i);
+
+    /*
+     * Advances gear 'i' alone by 'ticks' ticks, in closed form, and returns its rotations. Its
+     * rotations while engaged are reported with on_rotations(), and no other events are fired.
+     */
+    uint64_t spin(uint32_t i, uint64_t ticks);
+
+    /*
+     * Advances gear 'first' and the gears it drives by the ticks owed to them, in closed form.
+     * If 'observed_only' is true, unobserved gears are left with the ticks owed to them.
+     */
+    void settle(uint32_t first, bool observed_only);
+
+    /*
+     * Brings every unobserved gear with ticks owed up to date, along with the gears it drives.
+     */
+    void catch_up();
+
+    /*
+     * Finds the gears to park, and inserts them into the timing wheel. Every gear must be up to
+     * date. The gears of a tabulated gearbox were parked as its table was compiled, so they are
+     * only marked up to date.
+     */
+    void park();
+
+    /*
+     * Brings gear 'i' up to date if it is parked, without taking it out of the timing wheel, or if
+     * it is collapsed.
+     */
+    void sync(uint32_t i);
+
+    /*
+     * Takes the ratio and step of gear 'i' from the gear, after bringing it up to date. The gears
+     * of a scheduled gearbox are parked again before the next tick, as the retuned gear, and any
+     * it drives, rotate on different ticks, and the table of a tabulated one is removed. A gear
+     * retuned during a tick of a scheduled or tabulated gearbox is retuned once it finishes.
+     */
+    void retune(uint32_t i);
+
+    /*
+     * Applies the requests in the command queue, then calls repark_gears().
+     */
+    void apply_commands();
+
+    /*
+     * Retunes the gears whose retuning was put off during a tick, and parks the gears again if
+     * any were retuned or came to handle ticks they are parked through.
+     */
+    void repark_gears();
+
+    /*
+     * Brings every parked gear up to date, without taking it out of the timing wheel.
+     */
+    void sync_parked();
+
+    /*
+     * Ticks the gears that are not parked, and the parked gears due on this tick, in tick order.
+     */
+    void tick_scheduled();
+
+    /*
+     * Ticks parked gear 'i', which is due on the current tick, firing its events, and inserts it
+     * back into the timing wheel for its next rotation. Returns true if it rotated.
+     */
+    bool wake(uint32_t i);
+
+    /*
+     * Fires the events listed in the table for the current tick of the hyperperiod.
+     */
+    void tick_tabulated();
+
+    /*
+     * Returns the load of the heaviest of the next 'ticks' ticks, with gear 'i' at phases[i] and
+     * each of its rotations weighing weights[i]. If 'place' is true, gears with weight are first
+     * moved to the phase that keeps the heaviest tick lightest, in tick order, updating 'phases'.
+     */
+    double spread(std::vector<uint16_t>& phases, const std::vector<double>& weights,
+                  uint32_t ticks, bool place) const;
+
+    /*
+     * Advances a phase of a gear with 'ratio' and 'step' by 'ticks' ticks, in closed form, and
+     * returns the rotations it makes.
+     */
+    static uint64_t wind(uint64_t ratio, uint64_t step, uint64_t& phase, uint64_t ticks);
+
+    /*
+     * Returns 'base' + 'count' * 'by', or Never if it does not fit in 64 bits.
+     */
+    static uint64_t mul_add(uint64_t base, uint64_t count, uint64_t by);
+
+    /*
+     * Finds the subtrees made only of counters, and collapses them: each run of them driven by the
+     * same gear, one after another, is tallied once for every rotation of that gear instead of
+     * being ticked. A count is worked out from each gear between the root of the subtree and the
+     * counter, so only subtrees up to Max_Collapsed_Height gears deep are collapsed; of a deeper
+     * one, the subtrees at its bottom are.
+     */
+    void collapse();
+
+    static const uint32_t Max_Collapsed_Height = 8;
+
+    /*
+     * Counts a rotation of the gear driving the run of collapsed gears starting at gear 'i'.
+     */
+    void tally(uint32_t i)
+    {
+        std::atomic<uint64_t>& tally = folds[i].tally;
+        tally.store(tally.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /*
+     * Returns the rotations collapsed gear 'i' has made while engaged since it was last brought
+     * up to date. May be called from any thread.
+     */
+    uint64_t unreported(uint32_t i) const;
+
+    /*
+     * Brings the collapsed subtree holding gear 'i' up to date, as of the current point in the tick
+     * in progress.
+     */
+    void expand(uint32_t i);
+
+    /*
+     * Brings every collapsed subtree driven by gear 'i', directly or not, up to date.
+     */
+    void expand_collapsed(uint32_t i = 0);
+
+    /*
+     * Copies the phase, step, ratio and state of gear 'i', if it is collapsed, for unreported().
+     */
+    void publish(uint32_t i);
+
+    /*
+     * The fields of a gear used by a tick, packed into 16 bytes so four gears share a cache line.
+     * Everything else about the gear, its handlers and observer included, stays with the gear and
+     * is only touched when one of its events fires.
+     */
+    struct Node
+    {
+        uint16_t   phase;       // Base_Gear::phase
+        uint16_t   step;        // Base_Gear::step
+        uint16_t   ratio;       // Base_Gear::ratio
+        Gear_State state;       // Base_Gear::state
+        uint8_t    handled;     // Base_Gear::handled
+        bool       drives;      // true if the gear drives any other
+        bool       collapsed;   // true if the gear is in a subtree of counters, which is not ticked
+        bool       skips;       // true if the gear starts a run of collapsed gears
+        bool       wide;        // true if the gear starts a run of gears driving none, see widen()
+        uint32_t   end;         // index just past the last gear driven, directly or not, or
+                                // just past the gear if the gearbox has several instances
+    };
+
+    static_assert(sizeof(Node) == 16, "a node must fit in 16 bytes");
+
+    /*
+     * Finds the runs of at least Lanes gears in a row, in tick order, that drive no others and are
+     * not collapsed. Every gear of such a run is ticked once the first is, so tick_range() ticks
+     * the run a block of Lanes gears at a time.
+     */
+    void widen();
+
+    static const uint32_t Lanes = 16;
+    static const uint32_t Dense = 4;    // busy gears from which a block is turned gear by gear
+
+    /*
+     * Ticks the gears of a wide run from 'i' up to 'last', and returns 'last'.
+     */
+    uint32_t tick_wide(uint32_t i, uint32_t last);
+
+    /*
+     * Returns a mask of the Lanes gears from 'block' on, bit 0 for the first, that rotate on this
+     * tick or fire an event. Ticking any of the others only advances its phase by its step.
+     */
+    static uint32_t scan(const Node* block);
+
+    /*
+     * Ticks every instance of a gearbox compiled from several trees.
+     */
+    void tick_instances();
+
+    /*
+     * Returns true if gear 'i' is the drive gear of an instance, which has none of its own.
+     */
+    bool is_drive(uint32_t i) const { return i < copies; }
+
+    /*
+     * An event recorded while events are deferred, whose handler is called once the tick has
+     * finished, or listed in the table of a tabulated gearbox.
+     */
+    struct Record
+    {
+        uint32_t gear;
+        uint8_t  event;     // a Gear_Event, or 0 in a table for the tally of a collapsed run
+    };
+
+    /*
+     * Time a gear's rotation handler took while the gearbox was profiled.
+     */
+    struct Cost
+    {
+        uint64_t nanoseconds;
+        uint64_t rotations;
+    };
+
+    /*
+     * What a collapsed gear's count is worked out from. It may be read by any thread, so it is
+     * kept in atomics, written only by the ticking thread.
+     */
+    struct Fold
+    {
+        std::atomic<uint64_t> tally;    // at the start of a run: rotations of its drive gear
+        std::atomic<uint64_t> based;    // at a collapsed root: its run's tally when last updated
+        std::atomic<uint64_t> settled;  // phase, step, ratio and state as of then
+        uint32_t              run;      // at the start of a run its end, at other roots its start
+    };
+
+    std::vector<Node>       nodes;      // every gear, in tick order
+    std::vector<Base_Gear*> gears;      // the gears themselves, used to fire events
+    std::vector<uint32_t>   parents;    // index of each gear's drive gear (its own at a drive gear)
+    uint32_t                copies;     // instances of the tree, their gears interleaved by place
+
+    uint64_t                clock;      // ticks of the drive gear, counting the one in progress
+    std::vector<uint64_t>   rotated;    // tick on which each gear last rotated, or 0
+    uint32_t                visiting;   // gear whose events are firing, or size() between ticks
+
+    std::vector<uint8_t>    observed;   // true if a gear or any gear it drives is observed
+    std::atomic<bool>       reobserve;  // true if a gear handles more events than observe() found
+    std::vector<uint64_t>   due;        // tick of the next rotation of each gear, for horizon()
+    std::vector<uint64_t>   owed;       // ticks owed to each unobserved gear during advance()
+    std::vector<Frame>      frames;     // of each gear being settled, and those driving it
+    std::vector<uint32_t>   owing;      // unobserved gears with ticks owed (none driving another)
+
+    bool                    scheduled;  // true if gears are parked, in the wheel or in the table
+    Timing_Wheel            wheel;      // parked gears, by the tick on which they next rotate
+    std::vector<uint8_t>    parked;     // true if a gear is parked
+    std::vector<uint32_t>   jumps;      // first gear from each index on neither parked nor driven
+                                        // by a parked gear
+    std::vector<uint64_t>   turns;      // rotations of each gear while scheduled
+    std::vector<uint64_t>   synced;     // drive gear's turns when a parked gear was last updated
+    std::vector<uint64_t>   last;       // tick of the wheel on which each gear last rotated
+    uint32_t                cursor;     // gear being ticked by tick_scheduled() or
+                                        // tick_tabulated(), or size() between ticks
+    std::vector<uint32_t>   woken;      // parked gears due on the current tick
+    std::vector<uint32_t>   resume;     // (next, end) of each range interrupted by a woken gear
+
+    std::vector<uint32_t>   entries;    // start of each tick's events in the table, then its end
+    std::vector<Record>     table;      // events on each tick of the hyperperiod, in tick order
+    uint64_t                cycle;      // tick of the hyperperiod the next tick makes
+    uint32_t                limit;      // ticks of gears over the hyperperiod the table may make
+
+    bool                    profiled;   // true if rotation handlers are timed
+    std::vector<Cost>       costs;      // of each gear, or empty if never profiled
+
+    bool                    deferred;   // true if handlers are called once a tick has finished
+    std::vector<Record>     events;     // events recorded during the tick in progress, in order
+
+    Work_Pool*              pool;       // pool ticking the subtrees of the drive gear, or null
+    std::vector<uint32_t>   groups;     // first gear of each group of subtrees, then size()
+    bool                    parallel;   // true while the pool ticks the groups
+
+    std::unique_ptr<Fold[]> folds;      // of each gear, or null if no subtree is collapsed
+    std::vector<uint32_t>   spans;      // at the start of each wide run its end, or empty if none
+
+    Command_Queue*          commands;   // requests from other threads, or null
+    std::vector<Handler_Pool*> offloads; // pool calling each gear's handlers, or empty if none
+    bool                    repark;     // true if a parked gear has changed since it was parked
+    std::vector<uint32_t>   retuned;    // gears retuned during a tick of a scheduled gearbox
+
+    // read by snapshot() on other threads, so kept apart from the fields written by ticks
+    alignas(64) std::atomic<uint64_t> sequence;     // 2 per change to the gears, odd during one
+    std::atomic<uint64_t>             completed;    // the clock as of the last change completed
+};
+
+//-----------------------------------------------------------------------------------------------//
+
+/*
+ * Gearbox_Builder connects many gears at once. Connecting a gear with Base_Gear::connect() walks
+ * back over the gears of higher priority already driven by its drive gear to find its place, so
+ * connecting n gears of mixed priorities to the same drive gear can take O(n^2) time. The builder
+ * records the connections instead, and build() sorts them by drive gear and priority once and
+ * links them in a single pass, in O(n log n) time.
+ *
+ * The gears are linked in exactly the order they would have been had each been connected with
+ * Base_Gear::connect() in the order they were added to the builder, after any gears already
+ * connected. A gear added more than once is connected as it was added last.
+ */
+class Gearbox_Builder
+{
+public:
+
+    /*
+     * Reserves space for 'count' connections.
+     */
+    void reserve(size_t count) { connections.reserve(count); }
+
+    /*
+     * Records the connection of 'gear' to drive gear 'pinion', with the same arguments as
+     * Base_Gear::connect(). The gear is not connected, and keeps its ratio, phase, step and
+     * priority, until build() is called.
+     */
+    void connect(Base_Gear* gear, Base_Gear* pinion, uint16_t ratio, uint16_t phase = 0,
+                 uint16_t step = 1, uint16_t priority = 0);
+
+    /*
+     * Connects every gear recorded since the last build, and clears them from the builder. The
+     * gears must not be compiled into a Gearbox while they are connected.
+     */
+    void build();
+
+    /*
+     * Returns the number of connections recorded since the last build.
+     */
+    size_t size() const { return connections.size(); }
+
+private:
+
+    struct Connection
+    {
+        Base_Gear* gear;
+        Base_Gear* pinion;
+        uint16_t   ratio;
+        uint16_t   phase;
+        uint16_t   step;
+        uint16_t   priority;
+    };
+
+    std::vector<Connection> connections;    // in the order they were recorded
+};
+
+//-----------------------------------------------------------------------------------------------//
+
+// a gear parked by a scheduled gearbox, or collapsed, is brought up to date when its phase or
+// state is read
+
+inline Base_Gear::Gear_State Base_Gear::current_state() const
+{
+    if (gearbox == nullptr)
+    {
+        return state;
+    }
+    if (gearbox->scheduled || gearbox->nodes[node].collapsed)
+    {
+        gearbox->sync(node);
+    }
+    return gearbox->nodes[node].state;
+}
+
+inline Base_Gear::Gear_State& Base_Gear::current_state()
+{
+    if (gearbox == nullptr)
+    {
+        return state;
+    }
+    if (gearbox->scheduled || gearbox->nodes[node].collapsed)
+    {
+        gearbox->sync(node);
+    }
+    return gearbox->nodes[node].state;
+}
+
+inline uint16_t Base_Gear::get_phase() const
+{
+    if (gearbox == nullptr)
+    {
+        return phase;
+    }
+    if (gearbox->scheduled || gearbox->nodes[node].collapsed)
+    {
+        gearbox->sync(node);
+    }
+    return gearbox->nodes[node].phase;
+}
+
+inline uint64_t Base_Gear::get_tick() const
+{
+    return (gearbox != nullptr) ? gearbox->clock : 0;
+}
+
+inline uint64_t Base_Gear::get_last_rotation() const
+{
+    if (gearbox == nullptr)
+    {
+        return 0;
+    }
+    if (gearbox->nodes[node].collapsed)
+    {
+        gearbox->sync(node);
+    }
+    return gearbox->rotated[node];
+}
+
+inline uint64_t Base_Gear::get_next_rotation() const
+{
+    return (gearbox != nullptr) ? gearbox->next_rotation(node) : 0;
+}
+
+inline uint64_t Base_Gear::get_unreported_rotations() const
+{
+    // only collapsed gears, which are fixed when the gearbox is compiled, have any
+    return (gearbox != nullptr && gearbox->nodes[node].collapsed) ? gearbox->unreported(node) : 0;
+}
+
+inline void Base_Gear::set_handled_events(uint8_t events)
+{
+    uint8_t more = events & ~handled;
+    handled = events;
+    if (gearbox != nullptr)
+    {
+        gearbox->nodes[node].handled = events;
+        if (more != 0)
+        {
+            gearbox->handle_more(node, more);
+        }
+    }
+}
+
+inline uint8_t Base_Gear::get_handled_events() const
+{
+    return handled;
+}
+
 #endif // _WELLWOOD_GEARBOX_H_ //
@@ -0,0 +1,539 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+/*
+ * Benchmarks the cost of a tick, for trees of several shapes and sizes, ticked by each engine.
+ * Build it without the demo in gearbox.cpp:
+ *
+ *     g++ -std=c++17 -O2 -pthread -DGEARBOX_NO_MAIN gearbox.cpp timing_wheel.cpp work_pool.cpp \
+ *         command_queue.cpp handler_pool.cpp gearbox_bench.cpp
+ *
+ * Options:
+ *
+ *     --csv           print one line of comma separated values per result, after a header line,
+ *                     for comparing results between versions
+ *     --shape NAME    only benchmark trees of the named shape: chain, fanout, balanced,
+ *                     counters, handlers, entities, unmasked or instances
+ *     --min N         smallest tree, in gears (default 10)
+ *     --max N         largest tree, in gears (default 10000000)
+ *     --runs N        runs per result, of which the fastest is reported (default 5)
+ *     --uncollapsed   build the trees of a class derived from Counter, which the gearbox ticks
+ *                     as it does any other gear rather than collapsing them
+ *
+ * Each result is the time per tick of the drive gear, and the number of calls per second to the
+ * handlers of the gears' rotations. A gearbox collapses the subtrees of Counters, whose handlers
+ * are not called, their counts being worked out when read, so by default the chain, fanout and
+ * balanced shapes, made only of counters, mostly measure the tally of their collapsed runs. The
+ * "instances" shape is many copies of a small tree of timers, ticked by a gearbox each or by one
+ * gearbox compiled from them all.
+ */
+
+#include "gearbox.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * A counter that handles every event, as every gear did before handled events were masked, so
+ * each tick makes a virtual call to on_tick() that does nothing.
+ */
+class Unmasked_Counter : public Base_Gear
+{
+public:
+
+    Unmasked_Counter()
+    : Base_Gear(0, 1)
+    , total(0)
+    { }
+
+    uint64_t count() const { return total; }
+
+protected:
+
+    virtual void on_rotation() override { total += 1; }
+
+private:
+
+    uint64_t total;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * A counter that counts the calls to its handlers. A gearbox collapses only Counters and not the
+ * classes derived from them, so it ticks this counter as it would any gear.
+ */
+class Ticked_Counter : public Counter
+{
+public:
+
+    uint64_t calls() const { return handled; }
+
+protected:
+
+    virtual void on_rotation() override { handled++; Counter::on_rotation(); }
+
+    virtual void on_rotations(uint64_t rotations) override
+    {
+        handled++;
+        Counter::on_rotations(rotations);
+    }
+
+private:
+
+    uint64_t handled = 0;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Observes the gears of a tree that handle their rotations with Gear<T>.
+ */
+class Sink
+{
+public:
+
+    void rotated() { rotations++; }
+
+    uint64_t rotations = 0;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * A tree of gears to benchmark, and the calls to the handlers of its gears. The gears are held in
+ * deques, which never move them. Its counters are Ticked_Counters if 'uncollapsed' is true.
+ */
+class Tree
+{
+public:
+
+    explicit Tree(bool uncollapsed = false)
+    : drive(0, 1)
+    , uncollapsed(uncollapsed)
+    { }
+
+    /*
+     * Connects a new gear of the given kind to 'pinion', and returns it.
+     */
+    Base_Gear* add_counter(Base_Gear* pinion, uint16_t ratio, uint16_t phase)
+    {
+        if (uncollapsed)
+        {
+            ticked.emplace_back();
+            ticked.back().connect(pinion, ratio, phase);
+            return &ticked.back();
+        }
+        counters.emplace_back();
+        counters.back().connect(pinion, ratio, phase);
+        return &counters.back();
+    }
+
+    Base_Gear* add_handled(Base_Gear* pinion, uint16_t ratio, uint16_t phase)
+    {
+        handled.emplace_back(&sink);
+        handled.back().handle_rotation(&Sink::rotated);
+        handled.back().connect(pinion, ratio, phase);
+        return &handled.back();
+    }
+
+    Base_Gear* add_unmasked(Base_Gear* pinion, uint16_t ratio, uint16_t phase)
+    {
+        unmasked.emplace_back();
+        unmasked.back().connect(pinion, ratio, phase);
+        return &unmasked.back();
+    }
+
+    /*
+     * Returns the number of calls so far to the rotation handlers of the gears driven by the
+     * drive gear. The rotations of a collapsed counter are counted without calling its handlers
+     * until it is brought up to date, and are left out until then.
+     */
+    uint64_t calls() const
+    {
+        uint64_t total = sink.rotations;
+        for (const Counter& counter : counters)
+        {
+            total += counter.count() - counter.get_unreported_rotations();
+        }
+        for (const Ticked_Counter& counter : ticked)
+        {
+            total += counter.calls();
+        }
+        for (const Unmasked_Counter& counter : unmasked)
+        {
+            total += counter.count();
+        }
+        return total;
+    }
+
+    Counter drive;
+
+private:
+
+    bool                         uncollapsed;
+    Sink                         sink;
+    std::deque<Counter>          counters;
+    std::deque<Ticked_Counter>   ticked;
+    std::deque<Gear<Sink>>       handled;
+    std::deque<Unmasked_Counter> unmasked;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * The shapes of tree benchmarked. Each builds a tree of 'gears' gears, counting the drive gear.
+ */
+static void build_chain(Tree& tree, uint32_t gears)
+{
+    // each gear drives the next, and all rotate on every tick
+    Base_Gear* pinion = &tree.drive;
+    for (uint32_t i = 1; i < gears; i++)
+    {
+        pinion = tree.add_counter(pinion, 1, 0);
+    }
+}
+
+static void build_fanout(Tree& tree, uint32_t gears)
+{
+    // the drive gear drives every other gear. like statistics counters, each rotates about once
+    // every thousand ticks.
+    for (uint32_t i = 1; i < gears; i++)
+    {
+        tree.add_counter(&tree.drive, 1000 + (i % 8), i % 1000);
+    }
+}
+
+/*
+ * Builds a tree in which each gear drives eight others, with a ratio of 2, so each level rotates
+ * half as often as the one above it. Every 'handled_every'th gear is a Gear<T> handling its
+ * rotations, and the rest are counters.
+ */
+static void build_balanced(Tree& tree, uint32_t gears, uint32_t handled_every)
+{
+    std::vector<Base_Gear*> built;
+    built.reserve(gears);
+    built.push_back(&tree.drive);
+    for (uint32_t i = 1; i < gears; i++)
+    {
+        Base_Gear* pinion = built[(i - 1) / 8];
+        if (handled_every != 0 && i % handled_every == 0)
+        {
+            built.push_back(tree.add_handled(pinion, 2, i % 2));
+        }
+        else
+        {
+            built.push_back(tree.add_counter(pinion, 2, i % 2));
+        }
+    }
+}
+
+static void build_balanced(Tree& tree, uint32_t gears) { build_balanced(tree, gears, 0); }
+
+static void build_mostly_counters(Tree& tree, uint32_t gears) { build_balanced(tree, gears, 16); }
+
+static void build_handlers(Tree& tree, uint32_t gears) { build_balanced(tree, gears, 1); }
+
+static void build_entities(Tree& tree, uint32_t gears)
+{
+    // a gear per entity, handling its rotations, each about once every thousand ticks, all driven
+    // by the same pinion, like a milliseconds counter
+    Base_Gear* pinion = tree.add_counter(&tree.drive, 1, 0);
+    for (uint32_t i = 2; i < gears; i++)
+    {
+        tree.add_handled(pinion, 1000 + (i % 8), i % 1000);
+    }
+}
+
+static void build_unmasked(Tree& tree, uint32_t gears)
+{
+    // the fanout tree of counters that make a call to on_tick() on every tick, for comparison
+    for (uint32_t i = 1; i < gears; i++)
+    {
+        tree.add_unmasked(&tree.drive, 1000 + (i % 8), i % 1000);
+    }
+}
+
+struct Shape
+{
+    const char* name;
+    void (*build)(Tree& tree, uint32_t gears);
+};
+
+static const Shape shapes[] =
+{
+    { "chain",      build_chain },
+    { "fanout",     build_fanout },
+    { "balanced",   build_balanced },
+    { "counters",   build_mostly_counters },
+    { "handlers",   build_handlers },
+    { "entities",   build_entities },
+    { "unmasked",   build_unmasked },
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+struct Result
+{
+    double ns_per_tick;
+    double events_per_second;
+};
+
+/*
+ * Returns the fastest of 'runs' runs of 'ticks' ticks of 'tree', ticked with Base_Gear::tick(),
+ * or with Gearbox::tick() if 'gearbox' is not null.
+ */
+static Result measure(Tree& tree, Gearbox* gearbox, uint32_t ticks, int runs)
+{
+    Result best = { 0.0, 0.0 };
+    for (int run = 0; run < runs; run++)
+    {
+        uint64_t calls = tree.calls();
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t t = 0; t < ticks; t++)
+        {
+            if (gearbox != nullptr)
+            {
+                gearbox->tick();
+            }
+            else
+            {
+                tree.drive.tick();
+            }
+        }
+        auto stop = std::chrono::steady_clock::now();
+        calls = tree.calls() - calls;
+
+        double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+        if (run == 0 || ns / ticks < best.ns_per_tick)
+        {
+            best.ns_per_tick = ns / ticks;
+            best.events_per_second = (ns > 0.0) ? calls * 1e9 / ns : 0.0;
+        }
+    }
+    return best;
+}
+
+/*
+ * As measure(), for the instances of a tree in 'trees', ticked by a gearbox each in 'gearboxes',
+ * or by 'gearbox' if it is not null.
+ */
+static Result measure_instances(std::deque<Tree>& trees,
+                                std::vector<std::unique_ptr<Gearbox>>& gearboxes,
+                                Gearbox* gearbox, uint32_t ticks, int runs)
+{
+    auto calls = [&trees]()
+    {
+        uint64_t total = 0;
+        for (const Tree& tree : trees)
+        {
+            total += tree.calls();
+        }
+        return total;
+    };
+
+    Result best = { 0.0, 0.0 };
+    for (int run = 0; run < runs; run++)
+    {
+        uint64_t before = calls();
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t t = 0; t < ticks; t++)
+        {
+            if (gearbox != nullptr)
+            {
+                gearbox->tick();
+            }
+            else
+            {
+                for (std::unique_ptr<Gearbox>& g : gearboxes)
+                {
+                    g->tick();
+                }
+            }
+        }
+        auto stop = std::chrono::steady_clock::now();
+        uint64_t made = calls() - before;
+
+        double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+        if (run == 0 || ns / ticks < best.ns_per_tick)
+        {
+            best.ns_per_tick = ns / ticks;
+            best.events_per_second = (ns > 0.0) ? made * 1e9 / ns : 0.0;
+        }
+    }
+    return best;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+static void report(bool csv, const char* shape, const char* engine, uint32_t gears,
+                   uint32_t ticks, const Result& result)
+{
+    if (csv)
+    {
+        printf("%s,%s,%u,%u,%.2f,%.0f\n", shape, engine, gears, ticks, result.ns_per_tick,
+               result.events_per_second);
+    }
+    else
+    {
+        printf("%-10s %-10s %10u %10u %16.1f %16.0f\n", shape, engine, gears, ticks,
+               result.ns_per_tick, result.events_per_second);
+    }
+    fflush(stdout);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+int main(int argc, char** argv)
+{
+    bool csv = false;
+    const char* only = nullptr;
+    uint32_t min_gears = 10;
+    uint32_t max_gears = 10000000;
+    int runs = 5;
+    bool uncollapsed = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--csv") == 0)
+        {
+            csv = true;
+        }
+        else if (strcmp(argv[i], "--shape") == 0 && i + 1 < argc)
+        {
+            only = argv[++i];
+        }
+        else if (strcmp(argv[i], "--min") == 0 && i + 1 < argc)
+        {
+            min_gears = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc)
+        {
+            max_gears = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+        {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--uncollapsed") == 0)
+        {
+            uncollapsed = true;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--csv] [--shape NAME] [--min N] [--max N] [--runs N] "
+                    "[--uncollapsed]\n", argv[0]);
+            fprintf(stderr, "shapes:");
+            for (const Shape& shape : shapes)
+            {
+                fprintf(stderr, " %s", shape.name);
+            }
+            fprintf(stderr, " instances\n");
+            return 1;
+        }
+    }
+    if (runs < 1 || min_gears < 2)
+    {
+        fprintf(stderr, "need at least one run and two gears\n");
+        return 1;
+    }
+
+    if (csv)
+    {
+        printf("shape,engine,gears,ticks,ns_per_tick,events_per_second\n");
+    }
+    else
+    {
+        printf("%-10s %-10s %10s %10s %16s %16s\n", "shape", "engine", "gears", "ticks",
+               "ns/tick", "events/s");
+    }
+
+    for (const Shape& shape : shapes)
+    {
+        if (only != nullptr && strcmp(only, shape.name) != 0)
+        {
+            continue;
+        }
+
+        for (uint64_t gears = min_gears; gears <= max_gears; gears *= 10)
+        {
+            // about the same work per run at every size, but at least a few ticks
+            uint32_t ticks = (uint32_t)(20000000 / gears);
+            if (ticks < 16)
+            {
+                ticks = 16;
+            }
+
+            Tree tree(uncollapsed);
+            shape.build(tree, (uint32_t)gears);
+
+            report(csv, shape.name, "base_gear", (uint32_t)gears, ticks,
+                   measure(tree, nullptr, ticks, runs));
+
+            Gearbox gearbox(&tree.drive);
+            report(csv, shape.name, "gearbox", (uint32_t)gears, ticks,
+                   measure(tree, &gearbox, ticks, runs));
+
+            gearbox.defer(true);
+            report(csv, shape.name, "deferred", (uint32_t)gears, ticks,
+                   measure(tree, &gearbox, ticks, runs));
+            gearbox.defer(false);
+
+            gearbox.schedule(true);
+            report(csv, shape.name, "scheduled", (uint32_t)gears, ticks,
+                   measure(tree, &gearbox, ticks, runs));
+        }
+    }
+
+    // instances of a tree of eight gears, a drive gear driving seven timers handling their
+    // rotations, like a set of timers per entity
+    const uint32_t per_instance = 8;
+    for (uint64_t gears = min_gears; gears <= max_gears; gears *= 10)
+    {
+        if ((only != nullptr && strcmp(only, "instances") != 0) || gears < per_instance)
+        {
+            continue;
+        }
+
+        uint32_t ticks = (uint32_t)(20000000 / gears);
+        if (ticks < 16)
+        {
+            ticks = 16;
+        }
+
+        std::deque<Tree> trees;
+        std::vector<Base_Gear*> drives;
+        std::vector<std::unique_ptr<Gearbox>> gearboxes;
+        for (uint64_t i = 0; i < gears / per_instance; i++)
+        {
+            trees.emplace_back();
+            for (uint32_t j = 1; j < per_instance; j++)
+            {
+                trees.back().add_handled(&trees.back().drive, 1000 + j, (i * 7 + j) % 1000);
+            }
+            drives.push_back(&trees.back().drive);
+            gearboxes.emplace_back(new Gearbox(drives.back()));
+        }
+
+        report(csv, "instances", "gearboxes", (uint32_t)gears, ticks,
+               measure_instances(trees, gearboxes, nullptr, ticks, runs));
+
+        gearboxes.clear();
+        Gearbox gearbox(drives);
+        report(csv, "instances", "interleave", (uint32_t)gears, ticks,
+               measure_instances(trees, gearboxes, &gearbox, ticks, runs));
+    }
+
+    return 0;
+}
@@ -0,0 +1,1741 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+/*
+ * Tests the Gearbox against gears ticked through their links, which are the reference for what a
+ * tick does. Random trees are ticked both ways, in each of the gearbox's modes, while handlers
+ * engage, disengage and retune gears, and the events, phases, states and counts of every gear are
+ * compared after each tick. A few checks of particular cases follow. Build it without the demo in
+ * gearbox.cpp, with C++20 to also test gear_await.h:
+ *
+ *     g++ -std=c++20 -O2 -pthread -DGEARBOX_NO_MAIN gearbox.cpp timing_wheel.cpp work_pool.cpp \
+ *         command_queue.cpp handler_pool.cpp gearbox_test.cpp
+ *
+ * Options:
+ *
+ *     --seeds N       random trees tested in each mode (default 60)
+ *     --ticks N       ticks of each tree (default 400)
+ *
+ * Prints each failure, and exits with the number of tests that failed.
+ */
+
+#include "gearbox.h"
+#include "command_queue.h"
+#include "gear_await.h"
+#include "gear_train.h"
+#include "handler_pool.h"
+#include "work_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * The ways a tree is ticked by a gearbox, and what its handlers may change as it ticks.
+ */
+enum Mode { Plain, Scheduled, Tabulated, Deferred, Advanced, Interleaved, Parallel, Modes };
+
+static const char* mode_names[Modes] =
+{
+    "plain", "scheduled", "tabulated", "deferred", "advance", "interleaved", "parallel"
+};
+
+/*
+ * The kinds of gear in a random tree.
+ */
+enum Kind { Counting, Rotating, Handling, Batching, Kinds };
+
+/*
+ * The shape of a random tree: the drive gear is 0, and every other gear is driven by a gear
+ * before it.
+ */
+struct Spec
+{
+    std::vector<uint32_t> parents;
+    std::vector<uint8_t>  kinds;
+    std::vector<uint16_t> ratios;
+    std::vector<uint16_t> phases;
+    std::vector<uint16_t> steps;
+    std::vector<uint16_t> priorities;
+
+    uint32_t size() const { return (uint32_t)parents.size(); }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns a random tree of up to 'most' gears. Some trees drive long runs of siblings, which the
+ * gearbox ticks in blocks, and some subtrees hold only counters, which it collapses.
+ */
+static Spec random_spec(std::mt19937& rng, uint32_t most)
+{
+    Spec spec;
+    uint32_t n = 2 + rng() % (most - 1);
+    bool wide = (rng() % 3 == 0);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t parent = 0;
+        if (i > 1)
+        {
+            uint32_t pick = rng() % 10;
+            parent = (wide && pick < 6) ? 1 : rng() % i;
+        }
+        uint16_t ratio = (uint16_t)(1 + rng() % 12);
+        uint16_t step = (uint16_t)(1 + rng() % 2);
+        if (step > ratio)
+        {
+            step = ratio;
+        }
+
+        uint32_t pick = rng() % 10;
+        spec.parents.push_back(parent);
+        spec.kinds.push_back((uint8_t)((i == 0 || pick < 3) ? Counting :
+                                       (pick < 6) ? Rotating : (pick < 9) ? Handling : Batching));
+        spec.ratios.push_back(ratio);
+        spec.phases.push_back((uint16_t)(rng() % ratio));
+        spec.steps.push_back(step);
+        spec.priorities.push_back((uint16_t)(rng() % 3));
+    }
+    return spec;
+}
+
+//-----------------------------------------------------------------------------------------------//
+
+class Tree;
+
+/*
+ * Observes a gear of a tree: logs its events, and now and then changes a gear from its handlers,
+ * as drawn from a generator of its own, so a gear makes the same changes whichever thread ticks
+ * it and whatever other gears do.
+ */
+class Probe
+{
+public:
+
+    Probe(Tree* tree, uint32_t id, uint32_t seed)
+    : batched(0)
+    , tree(tree)
+    , id(id)
+    , rng(seed)
+    { }
+
+    void engaged() { log.push_back('e'); act(); }
+
+    void ticked() { log.push_back('t'); act(); }
+
+    void rotated() { log.push_back('r'); act(); }
+
+    void disengaged() { log.push_back('d'); act(); }
+
+    void rotations(uint64_t count) { batched += count; }
+
+    std::vector<char>    log;       // initials of the events, in the order they fired
+    uint64_t             batched;   // rotations reported in batches
+
+private:
+
+    void act();
+
+    Tree*        tree;
+    uint32_t     id;
+    std::mt19937 rng;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * A tree of gears connected as 'spec' describes. The gears are held in deques, which never move
+ * them.
+ */
+class Tree
+{
+public:
+
+    /*
+     * Connects the gears. Their handlers change gears as 'mode' allows, drawing from 'seed'. A
+     * reference tree queues the changes until the end of the tick if 'deferred' is true, as the
+     * handlers of a deferred gearbox make them then.
+     */
+    Tree(const Spec& spec, Mode mode, uint32_t seed, bool deferred)
+    : retunes(mode != Scheduled && mode != Tabulated && mode != Parallel)
+    , deferred(deferred)
+    {
+        const uint32_t n = spec.size();
+        gears.resize(n);
+        counters.resize(n, nullptr);
+        probes.resize(n, nullptr);
+        for (uint32_t i = 0; i < n; i++)
+        {
+            if (spec.kinds[i] == Counting)
+            {
+                counter_gears.emplace_back();
+                gears[i] = counters[i] = &counter_gears.back();
+                continue;
+            }
+
+            probe_list.emplace_back(this, i, seed * 7919 + i);
+            Probe* probe = probes[i] = &probe_list.back();
+            probe_gears.emplace_back(probe);
+            Gear<Probe>& gear = probe_gears.back();
+            if (spec.kinds[i] == Batching)
+            {
+                gear.handle_rotations(&Probe::rotations);
+            }
+            else
+            {
+                gear.handle_rotation(&Probe::rotated);
+            }
+            if (spec.kinds[i] == Handling)
+            {
+                gear.handle_engaged(&Probe::engaged);
+                gear.handle_tick(&Probe::ticked);
+                gear.handle_disengaged(&Probe::disengaged);
+            }
+            gears[i] = &gear;
+        }
+        for (uint32_t i = 1; i < n; i++)
+        {
+            gears[i]->connect(gears[spec.parents[i]], spec.ratios[i], spec.phases[i], spec.steps[i],
+                              spec.priorities[i]);
+        }
+
+        // the handlers of a gearbox ticked in parallel may only change the gears of their own
+        // subtree of the drive gear
+        std::vector<uint32_t> tops(n, 0);
+        scopes.resize(n);
+        for (uint32_t i = 1; i < n; i++)
+        {
+            tops[i] = (spec.parents[i] == 0) ? i : tops[spec.parents[i]];
+        }
+        for (uint32_t i = 1; i < n; i++)
+        {
+            for (uint32_t j = 1; j < n; j++)
+            {
+                if (mode != Parallel || tops[i] == tops[j])
+                {
+                    scopes[i].push_back(j);
+                }
+            }
+        }
+    }
+
+    /*
+     * Ticks the drive gear through its links, then makes the changes queued by the handlers.
+     */
+    void tick()
+    {
+        gears[0]->tick();
+        for (const Change& change : queued)
+        {
+            apply(change);
+        }
+        queued.clear();
+    }
+
+    /*
+     * Makes change 'kind' (0 disengages, 1 engages, 2 retunes) to gear 'target', now or at the
+     * end of the tick.
+     */
+    void change(uint32_t target, uint32_t kind, uint16_t ratio, uint16_t step)
+    {
+        if (kind == 2 && !retunes)
+        {
+            return;
+        }
+        Change change = { target, kind, ratio, step };
+        if (deferred)
+        {
+            queued.push_back(change);
+        }
+        else
+        {
+            apply(change);
+        }
+    }
+
+    std::vector<Base_Gear*>            gears;      // by index in the spec
+    std::vector<Counter*>              counters;   // of each gear that is a counter, or null
+    std::vector<Probe*>                probes;     // of each gear that is not, or null
+    std::vector<std::vector<uint32_t>> scopes;     // gears each gear's handlers may change
+
+private:
+
+    struct Change
+    {
+        uint32_t target;
+        uint32_t kind;
+        uint16_t ratio;
+        uint16_t step;
+    };
+
+    void apply(const Change& change)
+    {
+        Base_Gear* gear = gears[change.target];
+        if (change.kind == 2)
+        {
+            gear->retune(change.ratio, change.step);
+        }
+        else
+        {
+            gear->engage(change.kind == 1);
+        }
+    }
+
+    bool                     retunes;    // true if handlers may retune gears
+    bool                     deferred;   // true if changes wait for the end of the tick
+    std::vector<Change>      queued;
+    std::deque<Counter>      counter_gears;
+    std::deque<Probe>        probe_list;
+    std::deque<Gear<Probe>>  probe_gears;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Probe::act()
+{
+    // the draws are the same whatever is changed, so both trees stay in step
+    if (rng() % 4 != 0)
+    {
+        return;
+    }
+    const std::vector<uint32_t>& scope = tree->scopes[id];
+    uint32_t target = scope[rng() % scope.size()];
+    uint32_t kind = rng() % 3;
+    uint16_t ratio = (uint16_t)(2 + rng() % 11);
+    uint16_t step = (uint16_t)(1 + rng() % 2);
+    tree->change(target, kind, ratio, step);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Compares every gear of 'tree' with those of 'reference', and prints the first that differs.
+ * Returns true if they are all the same.
+ */
+static bool same(const Tree& tree, const Tree& reference, const char* test, uint32_t seed,
+                 uint64_t tick)
+{
+    for (uint32_t i = 0; i < tree.gears.size(); i++)
+    {
+        const Base_Gear* a = tree.gears[i];
+        const Base_Gear* b = reference.gears[i];
+        const char* what = nullptr;
+        if (a->get_phase() != b->get_phase() || a->get_ratio() != b->get_ratio())
+        {
+            what = "phase";
+        }
+        else if (a->is_engaged() != b->is_engaged() || a->is_disengaged() != b->is_disengaged())
+        {
+            what = "state";
+        }
+        else if (tree.counters[i] != nullptr &&
+                 tree.counters[i]->count() != reference.counters[i]->count())
+        {
+            what = "count";
+        }
+        else if (tree.probes[i] != nullptr && tree.probes[i]->log != reference.probes[i]->log)
+        {
+            what = "events";
+        }
+        else if (tree.probes[i] != nullptr &&
+                 tree.probes[i]->batched != reference.probes[i]->batched)
+        {
+            what = "batched rotations";
+        }
+        if (what != nullptr)
+        {
+            printf("%s: seed %u, tick %llu: gear %u has different %s\n", test, seed,
+                   (unsigned long long)tick, i, what);
+            return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Ticks a random tree in a gearbox in 'mode', and a copy of it through its links, and returns
+ * true if they stay the same. The test also engages, disengages and retunes gears between ticks.
+ */
+static bool check_mode(Mode mode, uint32_t seed, uint64_t ticks, Work_Pool& pool)
+{
+    std::mt19937 rng(seed * 31 + mode);
+    Spec spec = random_spec(rng, 60);
+    const uint32_t copies = (mode == Interleaved) ? 3 : 1;
+
+    std::deque<Tree> trees;
+    std::deque<Tree> references;
+    std::vector<Base_Gear*> drives;
+    for (uint32_t k = 0; k < copies; k++)
+    {
+        trees.emplace_back(spec, mode, seed + k, false);
+        references.emplace_back(spec, mode, seed + k, mode == Deferred);
+        drives.push_back(trees.back().gears[0]);
+    }
+
+    Gearbox gearbox(drives);
+    switch (mode)
+    {
+    case Scheduled:
+        gearbox.schedule(true);
+        break;
+    case Deferred:
+        gearbox.defer(true);
+        break;
+    case Parallel:
+        gearbox.parallelize(&pool, 1 + rng() % 8);
+        break;
+    default:
+        break;
+    }
+
+    uint64_t tick = 0;
+    while (tick < ticks)
+    {
+        if (mode == Tabulated && !gearbox.is_tabulated())
+        {
+            gearbox.tabulate(1 << 16);
+        }
+
+        uint32_t pick = rng() % 16;
+        if (pick < 3)
+        {
+            uint32_t target = 1 + rng() % (spec.size() - 1);
+            uint16_t ratio = (uint16_t)(2 + rng() % 11);
+            uint16_t step = (uint16_t)(1 + rng() % 2);
+            for (uint32_t k = 0; k < copies; k++)
+            {
+                Base_Gear* a = trees[k].gears[target];
+                Base_Gear* b = references[k].gears[target];
+                if (pick == 2)
+                {
+                    a->retune(ratio, step);
+                    b->retune(ratio, step);
+                }
+                else
+                {
+                    a->engage(pick == 1);
+                    b->engage(pick == 1);
+                }
+            }
+        }
+
+        uint64_t count = (mode == Advanced) ? 1 + rng() % 20 : 1;
+        if (mode == Advanced)
+        {
+            gearbox.advance(count);
+        }
+        else
+        {
+            gearbox.tick();
+        }
+        for (uint64_t t = 0; t < count; t++)
+        {
+            for (Tree& reference : references)
+            {
+                reference.tick();
+            }
+        }
+        tick += count;
+
+        for (uint32_t k = 0; k < copies; k++)
+        {
+            if (!same(trees[k], references[k], mode_names[mode], seed, tick))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if compiling trees of different shapes as instances of one Gearbox throws, whether
+ * a later tree has another gear or a gear of another ratio, and leaves the trees to tick alone.
+ */
+static bool check_shapes()
+{
+    for (int variant = 0; variant < 2; variant++)
+    {
+        Counter first;
+        Counter second;
+        Counter a;
+        Counter b;
+        Counter c;
+        a.connect(&first, 2);
+        b.connect(&second, variant == 0 ? 2 : 3);
+        if (variant == 0)
+        {
+            c.connect(&second, 4);
+        }
+
+        bool thrown = false;
+        try
+        {
+            Gearbox gearbox(std::vector<Base_Gear*>{ &first, &second });
+        }
+        catch (const std::invalid_argument&)
+        {
+            thrown = true;
+        }
+        if (!thrown)
+        {
+            printf("shapes: instances of different shapes were compiled (variant %d)\n", variant);
+            return false;
+        }
+
+        for (int t = 0; t < 12; t++)
+        {
+            second.tick();
+        }
+        if (b.count() != (variant == 0 ? 6u : 4u))
+        {
+            printf("shapes: tree left alone ticked wrong (variant %d)\n", variant);
+            return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if advance() keeps gears the same as ticking them does when they are connected
+ * with a step larger than their ratio, a phase at or past it, or no ratio at all.
+ */
+static bool check_advance()
+{
+    //                 parent  kind      ratio  phase  step
+    const uint32_t gears[][5] =
+    {
+        {      0,  Counting,     1,     0,     1 },
+        {      0,  Counting,     3,     0,     7 },     // step past the ratio
+        {      1,  Counting,     4,     2,     9 },
+        {      1,  Rotating,     2,     1,     5 },
+        {      0,  Counting,     5,     9,     5 },     // phase past a ratio equal to the step
+        {      0,  Counting,     6,    40,     2 },     // phase past the ratio
+        {      5,  Counting,     3,     0,     1 },
+        {      0,  Rotating,     7,    30,     3 },
+        {      0,  Counting,     1, 65000, 60000 },     // phase past 16 bits
+        {      0,  Counting,     0,     0,     1 },     // no ratio
+    };
+    Spec spec;
+    for (const uint32_t* g : gears)
+    {
+        spec.parents.push_back(g[0]);
+        spec.kinds.push_back((uint8_t)g[1]);
+        spec.ratios.push_back((uint16_t)g[2]);
+        spec.phases.push_back((uint16_t)g[3]);
+        spec.steps.push_back((uint16_t)g[4]);
+        spec.priorities.push_back(0);
+    }
+
+    for (uint32_t seed = 1; seed <= 20; seed++)
+    {
+        std::mt19937 rng(seed);
+        Tree tree(spec, Advanced, seed, false);
+        Tree reference(spec, Advanced, seed, false);
+        Gearbox gearbox(tree.gears[0]);
+        uint64_t tick = 0;
+        while (tick < 2000)
+        {
+            uint64_t count = 1 + rng() % 100;
+            gearbox.advance(count);
+            for (uint64_t t = 0; t < count; t++)
+            {
+                reference.tick();
+            }
+            tick += count;
+            if (!same(tree, reference, "advance", seed, tick))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if next_event() is the number of ticks to the next event found by ticking, with a
+ * disengaged gear, a collapsed subtree of counters and a gear that handles its ticks, scheduled
+ * or not, and if the phases of the gears ticked repeat after hyperperiod() ticks.
+ */
+static bool check_next_event()
+{
+    struct Seen
+    {
+        void fired() { (*events)++; }
+        uint64_t* events;
+    };
+
+    for (int scheduled = 0; scheduled < 2; scheduled++)
+    {
+        uint64_t events = 0;
+        Seen seen = { &events };
+        Counter drive;
+        Gear<Seen> off(&seen);
+        off.handle_rotation(&Seen::fired);
+        off.connect(&drive, 2);
+        off.engage(false);
+        Counter a;
+        a.connect(&drive, 3);
+        Counter b;
+        b.connect(&a, 4, 1);
+        Counter c;
+        c.connect(&drive, 5, 2);
+        Gear<Seen> ticker(&seen);
+        ticker.handle_tick(&Seen::fired);
+        ticker.connect(&c, 6);
+        Gear<Seen> late(&seen);
+        late.handle_rotation(&Seen::fired);
+        late.connect(&drive, 7, 3);
+        Base_Gear* ticked[] = { &off, &c, &ticker, &late };
+
+        Gearbox gearbox(&drive);
+        gearbox.schedule(scheduled != 0);
+        for (int round = 0; round < 40; round++)
+        {
+            if (round % 5 == 4)
+            {
+                ticker.engage(round % 10 != 4);
+            }
+            if (round == 20)
+            {
+                off.engage(true);
+            }
+
+            uint64_t next = gearbox.next_event();
+            uint64_t before = events;
+            uint64_t ticks = 0;
+            while (events == before && ticks < 1000)
+            {
+                gearbox.tick();
+                ticks++;
+            }
+            uint64_t expected = (events == before) ? Gearbox::Never : ticks;
+            if (next != expected)
+            {
+                printf("next event: %llu ticks away rather than %llu, round %d%s\n",
+                       (unsigned long long)next, (unsigned long long)expected, round,
+                       scheduled ? ", scheduled" : "");
+                return false;
+            }
+        }
+
+        // periods of 2, 5, 5 * 6 and 7 ticks. the collapsed counters are only tallied, so their
+        // periods are left out.
+        const uint64_t period = gearbox.hyperperiod();
+        std::vector<uint16_t> phases;
+        for (Base_Gear* gear : ticked)
+        {
+            phases.push_back(gear->get_phase());
+        }
+        gearbox.advance(period);
+        for (uint32_t i = 0; i < phases.size(); i++)
+        {
+            if (period != 210 || ticked[i]->get_phase() != phases[i])
+            {
+                printf("next event: hyperperiod %llu, after which gear %u has phase %u, not %u\n",
+                       (unsigned long long)period, i, ticked[i]->get_phase(), phases[i]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Logs the events of a gear of a train, or of the tree of gears built to match it.
+ */
+struct Order
+{
+    void engaged() { log.push_back('e'); }
+    void ticked() { log.push_back('t'); }
+    void rotated() { log.push_back('r'); }
+    void disengaged() { log.push_back('d'); }
+    std::vector<char> log;
+};
+
+/*
+ * Returns true if a train ticks as the tree of Counters and Gear<T>s of the same shape does, while
+ * some of its gears are engaged and disengaged.
+ */
+static bool check_train()
+{
+    typedef Train<
+        Count_Rotations,
+        Child<Ratio<3>, Count_Rotations,
+            Child<Ratio<4>, Step<3>, Phase<2>, Count_Rotations>,
+            Child<Ratio<2>, On_Engaged<&Order::engaged>, On_Tick<&Order::ticked>,
+                  On_Rotation<&Order::rotated>, On_Disengaged<&Order::disengaged>>>,
+        Child<Ratio<5>, Phase<1>, Count_Rotations>> Shape;
+
+    Order trained;
+    Shape train;
+    train.child<0>().child<1>().observe(&trained);
+
+    Order linked;
+    Counter drive;
+    Counter a;
+    a.connect(&drive, 3);
+    Counter b;
+    b.connect(&a, 4, 2, 3);
+    Gear<Order> c(&linked);
+    c.handle_engaged(&Order::engaged);
+    c.handle_tick(&Order::ticked);
+    c.handle_rotation(&Order::rotated);
+    c.handle_disengaged(&Order::disengaged);
+    c.connect(&a, 2);
+    Counter d;
+    d.connect(&drive, 5, 1);
+
+    for (int t = 1; t <= 600; t++)
+    {
+        if (t % 50 == 0)
+        {
+            bool engaged = (t % 100 != 0);
+            train.child<0>().child<1>().engage(engaged);
+            c.engage(engaged);
+        }
+        if (t % 70 == 0)
+        {
+            bool engaged = (t % 140 != 0);
+            train.child<1>().engage(engaged);
+            d.engage(engaged);
+        }
+        train.tick();
+        drive.tick();
+
+        if (train.count() != drive.count() || train.child<0>().count() != a.count() ||
+            train.child<0>().child<0>().count() != b.count() ||
+            train.child<1>().count() != d.count() || trained.log != linked.log ||
+            train.child<0>().child<0>().get_phase() != b.get_phase())
+        {
+            printf("train: tick %d differs from the linked gears\n", t);
+            return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if Gearbox_Builder connects random trees as connect() does when called with the
+ * same arguments in the order they were recorded, the gears recorded more than once included.
+ */
+static bool check_builder(uint32_t seeds)
+{
+    for (uint32_t seed = 1; seed <= seeds; seed++)
+    {
+        std::mt19937 rng(seed);
+        Spec spec = random_spec(rng, 80);
+        const uint32_t n = spec.size();
+
+        struct Record
+        {
+            uint32_t gear, pinion;
+            uint16_t ratio, phase, step, priority;
+        };
+
+        // every gear is recorded with its place in the tree, last of its records, and now and
+        // then with an earlier one that it replaces
+        std::vector<Record> records;
+        for (uint32_t i = 1; i < n; i++)
+        {
+            if (rng() % 3 == 0)
+            {
+                Record early = { i, (uint32_t)(rng() % i), 1, 0, 1, (uint16_t)(rng() % 3) };
+                records.insert(records.begin() + rng() % (records.size() + 1), early);
+            }
+            Record late = { i, spec.parents[i], spec.ratios[i], spec.phases[i], spec.steps[i],
+                            spec.priorities[i] };
+            records.push_back(late);
+        }
+
+        Spec flat = spec;
+        std::fill(flat.kinds.begin() + 1, flat.kinds.end(), (uint8_t)Rotating);
+        flat.parents.assign(n, 0);
+        flat.ratios.assign(n, 1);
+
+        // the gears of both trees are first connected to the drive gear, then moved
+        Tree built(flat, Plain, seed, false);
+        Tree connected(flat, Plain, seed, false);
+        Gearbox_Builder builder;
+        for (const Record& r : records)
+        {
+            builder.connect(built.gears[r.gear], built.gears[r.pinion], r.ratio, r.phase, r.step,
+                            r.priority);
+            connected.gears[r.gear]->connect(connected.gears[r.pinion], r.ratio, r.phase, r.step,
+                                             r.priority);
+        }
+        builder.build();
+
+        for (uint32_t t = 1; t <= 200; t++)
+        {
+            built.tick();
+            connected.tick();
+            if (!same(built, connected, "builder", seed, t))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------------------------//
+
+/*
+ * Observes one gear, and from its first rotation does something to another.
+ */
+class Trigger
+{
+public:
+
+    void fire()
+    {
+        if (fired++ == 0 && action != nullptr)
+        {
+            action(this);
+        }
+    }
+
+    void (*action)(Trigger* trigger) = nullptr;
+    Base_Gear* gear = nullptr;
+    Base_Gear* other = nullptr;
+    uint32_t fired = 0;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if a gear connected by a builder from a handler, as by connect(), is not ticked
+ * until the next pass of its new drive gear.
+ */
+static bool check_build_in_handler()
+{
+    for (int built = 0; built < 2; built++)
+    {
+        Counter drive;
+        Trigger trigger;
+        Gear<Trigger> gear(&trigger);
+        gear.handle_rotation(&Trigger::fire);
+        gear.connect(&drive, 1);
+        Counter late;
+        trigger.other = &late;
+        trigger.gear = &drive;
+        if (built)
+        {
+            trigger.action = [](Trigger* t)
+            {
+                Gearbox_Builder builder;
+                builder.connect(t->other, t->gear, 2, 1);
+                builder.build();
+            };
+        }
+        else
+        {
+            trigger.action = [](Trigger* t) { t->other->connect(t->gear, 2, 1); };
+        }
+
+        drive.tick();
+        if (late.count() != 0 || late.get_phase() != 1)
+        {
+            printf("build in handler: gear connected %s was ticked on the same pass\n",
+                   built ? "by a builder" : "by connect()");
+            return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if the counts snapshot() copies on another thread, while the gearbox is ticked and
+ * advanced, all agree with the number of ticks it returns.
+ */
+static bool check_snapshot()
+{
+    // the drive gear counts every tick, and the counters it drives every second, third and
+    // fourth
+    Counter drive;
+    Counter counters[3];
+    std::vector<const Counter*> read(1, &drive);
+    for (uint16_t k = 0; k < 3; k++)
+    {
+        counters[k].connect(&drive, k + 2);
+        read.push_back(&counters[k]);
+    }
+
+    Gearbox gearbox(&drive);
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> wrong(0);
+    std::thread reader([&]
+    {
+        std::vector<uint64_t> counts;
+        while (!done)
+        {
+            uint64_t ticks = gearbox.snapshot(read, counts);
+            for (uint64_t k = 0; k < counts.size(); k++)
+            {
+                if (counts[k] != ticks / (k ? k + 1 : 1))
+                {
+                    wrong++;
+                }
+            }
+        }
+    });
+    uint64_t ticks = 0;
+    for (uint64_t t = 1; t <= 20000; t++)
+    {
+        if (t % 7 == 0)
+        {
+            gearbox.advance(t % 50);
+            ticks += t % 50;
+        }
+        else
+        {
+            gearbox.tick();
+            ticks++;
+        }
+    }
+    done = true;
+    reader.join();
+
+    std::vector<uint64_t> counts;
+    if (wrong != 0 || gearbox.snapshot(read, counts) != ticks || counts[0] != ticks)
+    {
+        printf("snapshot: %llu counts read on another thread disagree with the ticks\n",
+               (unsigned long long)wrong);
+        return false;
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if a gear disconnected from between two siblings stops turning while they go on,
+ * and once reconnected, turns again after them, as the gearbox built again ticks it.
+ */
+static bool check_reconnect()
+{
+    struct Named
+    {
+        void rotated() { log->push_back(name); }
+        char name;
+        std::vector<char>* log;
+    };
+
+    std::vector<char> log;
+    Named names[3] = { { 'a', &log }, { 'b', &log }, { 'c', &log } };
+    Counter drive;
+    Gear<Named> a(&names[0]);
+    Gear<Named> b(&names[1]);
+    Gear<Named> c(&names[2]);
+    a.handle_rotation(&Named::rotated);
+    b.handle_rotation(&Named::rotated);
+    c.handle_rotation(&Named::rotated);
+    a.connect(&drive, 2);
+    b.connect(&drive, 3);
+    c.connect(&drive, 4);
+    Counter under;
+    under.connect(&b, 2);
+
+    // ticks twelve times, on the last of which all three rotate, and returns the order they did
+    auto run = [&](bool compiled)
+    {
+        std::unique_ptr<Gearbox> gearbox(compiled ? new Gearbox(&drive) : nullptr);
+        size_t last = 0;
+        for (int t = 0; t < 12; t++)
+        {
+            last = log.size();
+            if (gearbox)
+            {
+                gearbox->tick();
+            }
+            else
+            {
+                drive.tick();
+            }
+        }
+        return std::string(log.begin() + last, log.end());
+    };
+    auto expect = [&](const char* when, const std::string& order, const char* expected,
+                      uint64_t as, uint64_t bs, uint64_t cs, uint64_t unders)
+    {
+        if (order != expected || (uint64_t)std::count(log.begin(), log.end(), 'a') != as ||
+            (uint64_t)std::count(log.begin(), log.end(), 'b') != bs ||
+            (uint64_t)std::count(log.begin(), log.end(), 'c') != cs || under.count() != unders)
+        {
+            printf("reconnect: %s, gears turned in order %s and counted %llu, not %llu\n", when,
+                   order.c_str(), (unsigned long long)under.count(), (unsigned long long)unders);
+            return false;
+        }
+        return true;
+    };
+
+    if (!expect("before", run(true), "abc", 6, 4, 3, 2))
+    {
+        return false;
+    }
+    b.disconnect();
+    if (!expect("disconnected", run(false), "ac", 12, 4, 6, 2))
+    {
+        return false;
+    }
+    b.reconnect(&drive);
+    return expect("reconnected", run(true), "acb", 18, 8, 9, 4);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if requests queued by several threads into a small command queue, which wraps
+ * around and fills, leave each gear as the last requests of its thread say, while the gearbox
+ * ticks and drains the queue.
+ */
+static bool check_commands()
+{
+    const int producers = 3;
+    Command_Queue queue(8);
+    Counter drive;
+    std::deque<Counter> gears(producers);
+    for (Counter& gear : gears)
+    {
+        gear.connect(&drive, 10);
+    }
+
+    // the queue is filled before the gearbox first drains it
+    uint32_t queued = 0;
+    while (queue.engage(&gears[0], true))
+    {
+        queued++;
+    }
+    if (queued != 8)
+    {
+        printf("commands: a queue of 8 took %u requests\n", queued);
+        return false;
+    }
+
+    Gearbox gearbox(&drive);
+    gearbox.set_commands(&queue);
+    std::atomic<int> finished(0);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++)
+    {
+        threads.emplace_back([&queue, &gears, &finished, p]
+        {
+            // each thread's requests are applied in the order it queued them, so its last two
+            // leave its gear with a ratio of 2 + p, engaged if p is even
+            std::mt19937 rng(p);
+            Base_Gear* gear = &gears[p];
+            for (int k = 0; k < 2002; k++)
+            {
+                uint16_t ratio = (k == 2000) ? (uint16_t)(2 + p) : (uint16_t)(2 + rng() % 9);
+                bool engaged = (k == 2001) ? (p % 2 == 0) : (rng() % 2 == 0);
+                while (!((k % 2 == 0) ? queue.retune(gear, ratio) : queue.engage(gear, engaged)))
+                {
+                    std::this_thread::yield();
+                }
+            }
+            finished++;
+        });
+    }
+    while (finished < producers)
+    {
+        gearbox.tick();
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    // the gears take up their states on their next rotations
+    for (int t = 0; t < 20; t++)
+    {
+        gearbox.tick();
+    }
+    for (int p = 0; p < producers; p++)
+    {
+        if (gears[p].get_ratio() != 2 + p || gears[p].is_engaged() != (p % 2 == 0) ||
+            gears[p].is_disengaged() != (p % 2 != 0))
+        {
+            printf("commands: gear %d has ratio %u and is %s\n", p, gears[p].get_ratio(),
+                   gears[p].is_engaged() ? "engaged" : "not engaged");
+            return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if a gear that retunes itself from its handlers keeps its phase below its ratio,
+ * linked or in a gearbox.
+ */
+static bool check_self_retune()
+{
+    struct Self
+    {
+        void rotated() { n++; gear->retune((n % 2) ? 3 : 10, 1 + n % 3); }
+        void ticked() { if (n % 5 == 4) gear->retune(2); }
+        Gear<Self>* gear;
+        uint32_t n = 0;
+    };
+
+    for (int mode = 0; mode < 3; mode++)
+    {
+        Counter drive;
+        Self self;
+        Gear<Self> gear(&self);
+        self.gear = &gear;
+        gear.handle_rotation(&Self::rotated);
+        gear.handle_tick(&Self::ticked);
+        gear.connect(&drive, 10, 0, 4);
+
+        std::unique_ptr<Gearbox> gearbox(mode ? new Gearbox(&drive) : nullptr);
+        if (mode == 2)
+        {
+            gearbox->schedule(true);
+        }
+        for (int t = 0; t < 1000; t++)
+        {
+            if (gearbox)
+            {
+                gearbox->tick();
+            }
+            else
+            {
+                drive.tick();
+            }
+            if (gear.get_phase() >= gear.get_ratio())
+            {
+                printf("self retune: phase %u of ratio %u in mode %d\n", gear.get_phase(),
+                       gear.get_ratio(), mode);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if a counter collapsed below a retuned gear keeps the rotations it made before,
+ * and snapshot() reports the ticks made, however often collapsed counters are read.
+ */
+static bool check_collapsed()
+{
+    for (int scheduled = 0; scheduled < 2; scheduled++)
+    {
+        Counter drive;
+        Trigger trigger;
+        Gear<Trigger> gear(&trigger);
+        gear.handle_rotation(&Trigger::fire);
+        gear.connect(&drive, 2);
+        Counter counter;
+        counter.connect(&gear, 3);
+
+        Gearbox gearbox(&drive);
+        gearbox.schedule(scheduled != 0);
+        for (int t = 0; t < 16; t++)
+        {
+            gearbox.tick();
+        }
+        gear.retune(10);
+        for (int t = 0; t < 3; t++)
+        {
+            gearbox.tick();
+        }
+        if (counter.get_last_rotation() != 12 || counter.count() != 2)
+        {
+            printf("collapsed: last rotation %llu, count %llu after retuning its drive gear\n",
+                   (unsigned long long)counter.get_last_rotation(),
+                   (unsigned long long)counter.count());
+            return false;
+        }
+
+        std::vector<const Counter*> counters(1, &counter);
+        std::vector<uint64_t> counts;
+        uint64_t before = gearbox.snapshot(counters, counts);
+        counter.get_phase();
+        uint64_t after = gearbox.snapshot(counters, counts);
+        gearbox.advance(5);
+        uint64_t advanced = gearbox.snapshot(counters, counts);
+        if (before != 19 || after != 19 || advanced != 24)
+        {
+            printf("collapsed: snapshots at ticks %llu, %llu and %llu\n",
+                   (unsigned long long)before, (unsigned long long)after,
+                   (unsigned long long)advanced);
+            return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if advance() finds when each gear of a deep chain last rotated as ticking the chain
+ * one tick at a time does. Counting each gear back through every gear driving it would take time
+ * in the square of the depth.
+ */
+static bool check_deep_advance()
+{
+    const uint32_t depth = 200000;
+    std::vector<uint16_t> ratios(depth, 1);
+    std::vector<uint16_t> steps(depth, 1);
+    ratios[2] = 3;          // the ticks between its rotations are uneven
+    steps[2] = 2;
+    ratios[10] = 2;
+    ratios[150000] = 3;
+    steps[150000] = 2;
+
+    std::deque<Counter> chain(depth);
+    for (uint32_t d = 1; d < depth; d++)
+    {
+        chain[d].connect(&chain[d - 1], ratios[d], 0, steps[d]);
+    }
+    Gearbox gearbox(&chain[0]);
+
+    std::vector<uint32_t> phases(depth, 0);
+    std::vector<uint64_t> rotated(depth, 0);
+    uint64_t tick = 0;
+    for (uint32_t round = 0; round < 4; round++)
+    {
+        uint64_t count = 20 + round * 7;
+        gearbox.advance(count);
+        for (uint64_t t = 0; t < count; t++)
+        {
+            tick++;
+            rotated[0] = tick;
+            for (uint32_t d = 1; d < depth; d++)
+            {
+                phases[d] += steps[d];
+                if (phases[d] < ratios[d])
+                {
+                    break;
+                }
+                phases[d] -= ratios[d];
+                rotated[d] = tick;
+            }
+        }
+
+        for (uint32_t d = 0; d < depth; d++)
+        {
+            if (chain[d].get_last_rotation() != rotated[d] || chain[d].get_phase() != phases[d])
+            {
+                printf("deep advance: tick %llu: gear %u last rotated on %llu, not %llu\n",
+                       (unsigned long long)tick, d, (unsigned long long)chain[d].get_last_rotation(),
+                       (unsigned long long)rotated[d]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if a chain a million gears deep, each turning once per turn of the gear driving
+ * it, ticks to the bottom without overflowing the stack, on its own and in a gearbox that ticks
+ * and advances it.
+ */
+static bool check_deep_chain()
+{
+    const uint32_t depth = 1000000;
+    std::deque<Counter> chain(depth);
+    for (uint32_t d = 1; d < depth; d++)
+    {
+        chain[d].connect(&chain[d - 1], 1);
+    }
+
+    for (int t = 0; t < 3; t++)
+    {
+        chain[0].tick();
+    }
+    if (chain[depth - 1].count() != 3)
+    {
+        printf("deep chain: the last gear rotated %llu times in 3 ticks\n",
+               (unsigned long long)chain[depth - 1].count());
+        return false;
+    }
+
+    Gearbox gearbox(&chain[0]);
+    gearbox.tick();
+    gearbox.tick();
+    gearbox.advance(1000);
+    for (uint32_t d = 0; d < depth; d++)
+    {
+        if (chain[d].count() != 1005 || chain[d].get_last_rotation() != 1002)
+        {
+            printf("deep chain: gear %u rotated %llu times, last on %llu\n", d,
+                   (unsigned long long)chain[d].count(),
+                   (unsigned long long)chain[d].get_last_rotation());
+            return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if the timestamps read by a handler, and those of every gear between ticks, are the
+ * same as a simulation's, whether the gearbox is ticked or advanced, and with or without a pool in
+ * the modes that do not use it.
+ */
+static bool check_timestamps(Work_Pool& pool)
+{
+    struct Reader
+    {
+        void rotated()
+        {
+            seen.push_back(other->get_tick());
+            seen.push_back(other->get_last_rotation());
+            seen.push_back(other->get_next_rotation());
+        }
+        Base_Gear* other;
+        std::vector<uint64_t> seen;
+    };
+
+    // each gear's drive gear, ratio, phase and step, the drive gear first
+    const uint32_t count = 5;
+    const uint32_t parents[count] = { 0, 0, 0, 2, 3 };
+    const uint16_t ratios[count] = { 1, 2, 2, 3, 5 };
+    const uint16_t phases[count] = { 0, 0, 1, 0, 1 };
+    const uint16_t steps[count] = { 1, 1, 1, 1, 2 };
+    const uint64_t calls[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 7, 1, 0, 1, 1, 1, 12 };
+    const uint64_t horizon = 64;
+
+    std::vector<uint64_t> rotations[count];
+    uint32_t phase[count];
+    for (uint32_t g = 0; g < count; g++)
+    {
+        phase[g] = phases[g];
+    }
+    for (uint64_t tick = 1; tick <= horizon; tick++)
+    {
+        rotations[0].push_back(tick);
+        for (uint32_t g = 1; g < count; g++)
+        {
+            const std::vector<uint64_t>& drive = rotations[parents[g]];
+            if (drive.empty() || drive.back() != tick)
+            {
+                continue;
+            }
+            phase[g] += steps[g];
+            if (phase[g] >= ratios[g])
+            {
+                phase[g] -= ratios[g];
+                rotations[g].push_back(tick);
+            }
+        }
+    }
+
+    // the first gear rotates on even ticks, between the rotations of the second
+    std::vector<uint64_t> expected;
+    for (uint64_t tick = 2; tick <= 33; tick += 2)
+    {
+        expected.push_back(tick);
+        expected.push_back(tick - 1);
+        expected.push_back(tick + 1);
+    }
+
+    for (int mode = 0; mode < 4; mode++)
+    {
+        std::vector<uint64_t> seen[2];
+        for (int parallel = 0; parallel < (mode < 3 ? 2 : 1); parallel++)
+        {
+            Counter drive;
+            Reader reader;
+            Gear<Reader> first(&reader);
+            first.handle_rotation(&Reader::rotated);
+            first.connect(&drive, ratios[1], phases[1], steps[1]);
+            Gear<Reader> second(&reader);
+            second.connect(&drive, ratios[2], phases[2], steps[2]);
+            Counter counter;
+            counter.connect(&second, ratios[3], phases[3], steps[3]);
+            Counter stepped;
+            stepped.connect(&counter, ratios[4], phases[4], steps[4]);
+            reader.other = &second;
+            Base_Gear* gears[count] = { &drive, &first, &second, &counter, &stepped };
+
+            Gearbox gearbox(&drive);
+            if (parallel)
+            {
+                gearbox.parallelize(&pool, 1);
+            }
+            if (mode == 0)
+            {
+                gearbox.defer(true);
+            }
+            if (mode == 1)
+            {
+                gearbox.schedule(true);
+            }
+            if (mode == 2)
+            {
+                gearbox.tabulate(1000);
+            }
+
+            uint64_t tick = 0;
+            for (uint64_t ticks : calls)
+            {
+                if (ticks == 1)
+                {
+                    gearbox.tick();
+                }
+                else
+                {
+                    gearbox.advance(ticks);
+                }
+                tick += ticks;
+
+                for (uint32_t g = 0; g < count; g++)
+                {
+                    const std::vector<uint64_t>& r = rotations[g];
+                    auto next = std::upper_bound(r.begin(), r.end(), tick);
+                    uint64_t last = (next == r.begin()) ? 0 : *(next - 1);
+                    if (gears[g]->get_tick() != tick || gears[g]->get_last_rotation() != last ||
+                        gears[g]->get_next_rotation() != *next)
+                    {
+                        printf("timestamps: mode %d, tick %llu: gear %u has %llu, %llu and %llu, "
+                               "not %llu, %llu and %llu\n", mode, (unsigned long long)tick, g,
+                               (unsigned long long)gears[g]->get_tick(),
+                               (unsigned long long)gears[g]->get_last_rotation(),
+                               (unsigned long long)gears[g]->get_next_rotation(),
+                               (unsigned long long)tick, (unsigned long long)last,
+                               (unsigned long long)*next);
+                        return false;
+                    }
+                }
+            }
+            seen[parallel] = reader.seen;
+        }
+        if (seen[0] != expected)
+        {
+            printf("timestamps: a handler read the wrong ones in mode %d\n", mode);
+            return false;
+        }
+        if (mode < 3 && seen[1] != seen[0])
+        {
+            printf("timestamps: a pool changes them in mode %d\n", mode);
+            return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if a gearbox that cannot be tabulated stays scheduled.
+ */
+static bool check_tabulate()
+{
+    Counter drive;
+    Trigger trigger;
+    Gear<Trigger> a(&trigger);
+    a.handle_rotation(&Trigger::fire);
+    a.connect(&drive, 7);
+    Gear<Trigger> b(&trigger);
+    b.handle_rotation(&Trigger::fire);
+    b.connect(&drive, 11);
+
+    Gearbox gearbox(&drive);
+    gearbox.schedule(true);
+    for (int t = 0; t < 5; t++)
+    {
+        gearbox.tick();
+    }
+    bool small = gearbox.tabulate(5);
+    bool scheduled = gearbox.is_scheduled();
+    bool large = gearbox.tabulate(100000);
+    for (int t = 0; t < 72; t++)
+    {
+        gearbox.tick();
+    }
+    if (small || !scheduled || !large || gearbox.is_scheduled() || trigger.fired != 18)
+    {
+        printf("tabulate: a failed table left the gearbox %s\n",
+               scheduled ? "scheduled" : "unscheduled");
+        return false;
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if balance() lowers the peak number of rotation handlers called on a tick by gears
+ * connected with the same phases, profiled or not, and each gear still rotates as often over a
+ * hyperperiod.
+ */
+static bool check_balance()
+{
+    struct Tally
+    {
+        void rotated() { (*calls)[*tick]++; rotations++; }
+        std::vector<uint32_t>* calls;
+        uint64_t* tick;
+        uint64_t rotations = 0;
+    };
+
+    for (int profiled = 0; profiled < 2; profiled++)
+    {
+        std::vector<uint32_t> calls;
+        uint64_t tick = 0;
+        Counter drive;
+        std::deque<Tally> tallies(14);
+        std::deque<Gear<Tally>> gears;
+        for (uint32_t i = 0; i < tallies.size(); i++)
+        {
+            tallies[i].calls = &calls;
+            tallies[i].tick = &tick;
+            gears.emplace_back(&tallies[i]);
+            gears.back().handle_rotation(&Tally::rotated);
+            gears.back().connect(&drive, (i < 12) ? 6 : 4);
+        }
+
+        Gearbox gearbox(&drive);
+        gearbox.profile(profiled != 0);
+        const uint64_t period = gearbox.hyperperiod();
+        if (period != 12)
+        {
+            printf("balance: hyperperiod %llu rather than 12\n", (unsigned long long)period);
+            return false;
+        }
+
+        // ticks through a hyperperiod, counting the calls on each tick and the rotations of each
+        // gear, and returns the most calls on a tick
+        auto run = [&](std::vector<uint64_t>& rotations)
+        {
+            calls.assign(period, 0);
+            for (Tally& tally : tallies)
+            {
+                tally.rotations = 0;
+            }
+            for (tick = 0; tick < period; tick++)
+            {
+                gearbox.tick();
+            }
+            rotations.clear();
+            for (const Tally& tally : tallies)
+            {
+                rotations.push_back(tally.rotations);
+            }
+            return *std::max_element(calls.begin(), calls.end());
+        };
+
+        std::vector<uint64_t> before;
+        std::vector<uint64_t> after;
+        uint32_t peak_before = run(before);
+        Gearbox::Balance balance = gearbox.balance();
+        uint32_t peak_after = run(after);
+        if (peak_after >= peak_before || balance.after >= balance.before || after != before)
+        {
+            printf("balance: peak of %u calls on a tick became %u%s\n", peak_before, peak_after,
+                   (after != before) ? ", and the gears rotated differently" : "");
+            return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+/*
+ * Returns true if every rotation of an offloaded gear is handled on a worker thread, including
+ * those made during advance(), while a gear that is not offloaded is handled on this one.
+ */
+static bool check_offload()
+{
+    struct Where
+    {
+        void rotated() { (std::this_thread::get_id() == ticking ? here : away)++; }
+        void rotations(uint64_t count)
+        { (std::this_thread::get_id() == ticking ? here : away) += count; }
+        std::thread::id ticking = std::this_thread::get_id();
+        std::atomic<uint64_t> here{0};
+        std::atomic<uint64_t> away{0};
+    };
+
+    Handler_Pool handlers(1);
+    Where offloaded;
+    Where local;
+    Counter drive;
+    Gear<Where> a(&offloaded);
+    a.handle_rotations(&Where::rotations);
+    a.connect(&drive, 30);
+    Gear<Where> b(&local);
+    b.handle_rotation(&Where::rotated);
+    b.connect(&drive, 1000);
+    {
+        Gearbox gearbox(&drive);
+        gearbox.offload(&a, &handlers);
+        gearbox.advance(300);
+        gearbox.tick();
+        gearbox.advance(2700);
+        handlers.drain();
+    }
+    if (offloaded.here != 0 || offloaded.away != 100 || local.here != 3 || local.away != 0)
+    {
+        printf("offload: %llu rotations handled on the ticking thread, %llu on a worker\n",
+               (unsigned long long)offloaded.here, (unsigned long long)offloaded.away);
+        return false;
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+static std::vector<uint64_t> resumed;
+
+static Gear_Task waits(Awaitable_Gear& a, Awaitable_Gear& b)
+{
+    co_await a.rotations(2);
+    resumed.push_back(a.get_tick());
+    co_await b.rotations(1);
+    resumed.push_back(b.get_tick());
+    co_await b.next_tick();
+    resumed.push_back(b.get_tick());
+    co_await a.next_tick();
+    resumed.push_back(a.get_tick());
+}
+
+/*
+ * Returns true if coroutines waiting on gears resume on the same ticks whether the gearbox is
+ * scheduled or not, and whether it is ticked or advanced.
+ */
+static bool check_awaits()
+{
+    std::vector<uint64_t> expected;
+    for (int mode = 0; mode < 4; mode++)
+    {
+        Counter drive;
+        Awaitable_Gear a;
+        Awaitable_Gear b;
+        a.connect(&drive, 10);
+        b.connect(&drive, 5, 2);
+
+        Gearbox gearbox(&drive);
+        gearbox.schedule((mode & 1) != 0);
+        resumed.clear();
+        waits(a, b);
+        if (mode & 2)
+        {
+            gearbox.advance(40);
+        }
+        else
+        {
+            for (int t = 0; t < 40; t++)
+            {
+                gearbox.tick();
+            }
+        }
+        if (mode == 0)
+        {
+            expected = resumed;
+        }
+        else if (resumed != expected || resumed.size() != 4)
+        {
+            printf("awaits: resumed on different ticks in mode %d\n", mode);
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif // __cpp_impl_coroutine //
+
+//-----------------------------------------------------------------------------------------------//
+
+int main(int argc, char** argv)
+{
+    uint32_t seeds = 60;
+    uint64_t ticks = 400;
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--seeds") == 0 && a + 1 < argc)
+        {
+            seeds = (uint32_t)atoi(argv[++a]);
+        }
+        else if (strcmp(argv[a], "--ticks") == 0 && a + 1 < argc)
+        {
+            ticks = (uint64_t)atoll(argv[++a]);
+        }
+        else
+        {
+            printf("usage: %s [--seeds N] [--ticks N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Work_Pool pool(3);
+    int failed = 0;
+    for (int mode = 0; mode < Modes; mode++)
+    {
+        uint32_t passed = 0;
+        for (uint32_t seed = 1; seed <= seeds; seed++)
+        {
+            passed += check_mode((Mode)mode, seed, ticks, pool) ? 1 : 0;
+        }
+        printf("%-12s %u of %u trees\n", mode_names[mode], passed, seeds);
+        failed += (passed < seeds) ? 1 : 0;
+    }
+
+    failed += check_shapes() ? 0 : 1;
+    failed += check_advance() ? 0 : 1;
+    failed += check_next_event() ? 0 : 1;
+    failed += check_train() ? 0 : 1;
+    failed += check_builder(seeds * 4) ? 0 : 1;
+    failed += check_build_in_handler() ? 0 : 1;
+    failed += check_snapshot() ? 0 : 1;
+    failed += check_reconnect() ? 0 : 1;
+    failed += check_commands() ? 0 : 1;
+    failed += check_self_retune() ? 0 : 1;
+    failed += check_collapsed() ? 0 : 1;
+    failed += check_timestamps(pool) ? 0 : 1;
+    failed += check_deep_advance() ? 0 : 1;
+    failed += check_deep_chain() ? 0 : 1;
+    failed += check_tabulate() ? 0 : 1;
+    failed += check_balance() ? 0 : 1;
+    failed += check_offload() ? 0 : 1;
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    failed += check_awaits() ? 0 : 1;
+#endif
+
+    printf("%s\n", failed ? "FAILED" : "passed");
+    return failed;
+}
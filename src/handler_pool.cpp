@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#include "handler_pool.h"
+#include "gearbox.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Handler_Pool::Handler_Pool(unsigned workers, uint32_t capacity)
+: stopping(false)
+{
+    uint64_t size = 1;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    if (workers == 0)
+    {
+        workers = 1;
+    }
+    for (unsigned i = 0; i < workers; i++)
+    {
+        rings.emplace_back(new Ring());
+        Ring& ring = *rings.back();
+        ring.events.reset(new Event[size]);
+        ring.mask = size - 1;
+        ring.tail.store(0, std::memory_order_relaxed);
+        ring.dropped.store(0, std::memory_order_relaxed);
+        ring.peak.store(0, std::memory_order_relaxed);
+        ring.head.store(0, std::memory_order_relaxed);
+        ring.done.store(0, std::memory_order_relaxed);
+        ring.sleeping.store(false, std::memory_order_relaxed);
+    }
+    for (unsigned i = 0; i < workers; i++)
+    {
+        threads.emplace_back(&Handler_Pool::worker, this, i);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Handler_Pool::~Handler_Pool()
+{
+    stopping.store(true, std::memory_order_seq_cst);
+    for (std::unique_ptr<Ring>& ring : rings)
+    {
+        std::lock_guard<std::mutex> guard(ring->lock);
+        ring->posted.notify_one();
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+bool Handler_Pool::post(Base_Gear* gear, uint8_t event, uint32_t key)
+{
+    Ring& ring = *rings[key % rings.size()];
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    uint64_t depth = tail - ring.head.load(std::memory_order_acquire);
+    if (depth > ring.mask)
+    {
+        ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_relaxed);
+        return false;
+    }
+
+    ring.events[tail & ring.mask] = Event{ gear, event };
+    ring.tail.store(tail + 1, std::memory_order_seq_cst);
+    if (depth + 1 > ring.peak.load(std::memory_order_relaxed))
+    {
+        ring.peak.store((uint32_t)(depth + 1), std::memory_order_relaxed);
+    }
+
+    // the worker marks itself sleeping before it looks at the tail for the last time, so either
+    // it sees the event, or the event's poster sees it sleeping and wakes it
+    if (ring.sleeping.load(std::memory_order_seq_cst))
+    {
+        std::lock_guard<std::mutex> guard(ring.lock);
+        ring.posted.notify_one();
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Handler_Pool::drain()
+{
+    for (std::unique_ptr<Ring>& ring : rings)
+    {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        while (ring->done.load(std::memory_order_acquire) != tail)
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Handler_Pool::Ring_Stats Handler_Pool::stats(unsigned worker) const
+{
+    const Ring& ring = *rings[worker];
+    Ring_Stats stats;
+    uint64_t done = ring.done.load(std::memory_order_acquire);
+    uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    stats.dropped = ring.dropped.load(std::memory_order_relaxed);
+    stats.posted = tail + stats.dropped;
+    stats.depth = (uint32_t)(tail - done);
+    stats.peak = ring.peak.load(std::memory_order_relaxed);
+    return stats;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Handler_Pool::handle(Base_Gear* gear, uint8_t event)
+{
+    switch (event)
+    {
+    case Base_Gear::Engaged_Event:
+        gear->on_engaged();
+        break;
+    case Base_Gear::Tick_Event:
+        gear->on_tick();
+        break;
+    case Base_Gear::Rotation_Event:
+        gear->on_rotation();
+        break;
+    case Base_Gear::Disengaged_Event:
+        gear->on_disengaged();
+        break;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Handler_Pool::worker(unsigned self)
+{
+    Ring& ring = *rings[self];
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        if (ring.tail.load(std::memory_order_acquire) != head)
+        {
+            // the event is copied out, so its cell is free for the next while it is handled
+            Event event = ring.events[head & ring.mask];
+            ring.head.store(++head, std::memory_order_release);
+            handle(event.gear, event.event);
+            ring.done.store(head, std::memory_order_release);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(ring.lock);
+        ring.sleeping.store(true, std::memory_order_seq_cst);
+        ring.posted.wait(guard, [this, &ring, head]
+        {
+            return ring.tail.load(std::memory_order_seq_cst) != head ||
+                   stopping.load(std::memory_order_seq_cst);
+        });
+        ring.sleeping.store(false, std::memory_order_relaxed);
+        if (ring.tail.load(std::memory_order_acquire) == head)
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#ifndef _WELLWOOD_HANDLER_POOL_H_
+#define _WELLWOOD_HANDLER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Base_Gear;
+
+/*
+ * Handler_Pool calls the handlers of gears offloaded to it with Gearbox::offload() on worker
+ * threads, so slow handlers do not hold up the thread ticking the gears. Each worker takes events
+ * from a ring of its own, which the ticking thread alone fills, so posting an event to a busy
+ * worker takes no locks and never waits. A worker that has run out of events sleeps, and the
+ * event that wakes it is posted under the ring's lock, which the worker only holds while it goes
+ * to sleep or wakes. Every event of a gear goes to the same ring, so a gear's handlers are called
+ * one at a time, in the order its events fired. When a ring is full, the event is dropped and
+ * counted, rather than holding up the tick.
+ *
+ * A handler called by a worker runs alongside the ticks, so it may not engage, disengage, retune
+ * or read any gear, its own included, nor call the gearbox. It may request changes to gears
+ * through a Command_Queue. The gears offloaded to a pool must outlive it, or the events posted
+ * for them must be drained first.
+ */
+class Handler_Pool
+{
+public:
+
+    /*
+     * Starts 'workers' worker threads, at least one, each with a ring that holds up to 'capacity'
+     * events, rounded up to a power of two.
+     */
+    explicit Handler_Pool(unsigned workers, uint32_t capacity = 1024);
+
+    /*
+     * Calls the handlers of the events posted so far, then stops the workers.
+     */
+    ~Handler_Pool();
+
+    /*
+     * Posts 'event' (a Base_Gear::Gear_Event) of 'gear' to the ring chosen by 'key', and returns
+     * true, or drops it and returns false if the ring is full. Events posted with the same key are
+     * handled in the order they were posted. Takes the ring's lock to wake its worker if it is
+     * sleeping. May only be called by the thread ticking the gears.
+     */
+    bool post(Base_Gear* gear, uint8_t event, uint32_t key);
+
+    /*
+     * Returns once the handlers of every event posted so far have returned. May only be called by
+     * the thread ticking the gears.
+     */
+    void drain();
+
+    /*
+     * What has become of the events posted to a ring.
+     */
+    struct Ring_Stats
+    {
+        uint64_t posted;    // events posted to the ring, including those dropped
+        uint64_t dropped;   // events dropped because the ring was full
+        uint32_t depth;     // events waiting in the ring or being handled
+        uint32_t peak;      // greatest depth seen by the ticking thread when posting
+    };
+
+    /*
+     * Returns the stats of the ring of worker 'worker'. May be called by any thread, though the
+     * figures are read one at a time and may not agree exactly while events are being posted.
+     */
+    Ring_Stats stats(unsigned worker) const;
+
+    /*
+     * Returns the number of worker threads, and of rings.
+     */
+    unsigned size() const { return (unsigned)rings.size(); }
+
+private:
+
+    Handler_Pool(const Handler_Pool& other) = delete;
+    Handler_Pool& operator=(const Handler_Pool&) = delete;
+
+    struct Event
+    {
+        Base_Gear* gear;
+        uint8_t    event;
+    };
+
+    /*
+     * A ring filled by the ticking thread and emptied by one worker. The positions only grow, and
+     * each is only written by one side, so the ring holds events from head to tail.
+     */
+    struct Ring
+    {
+        std::unique_ptr<Event[]> events;
+        uint64_t                 mask;       // number of events the ring holds - 1
+
+        alignas(64) std::atomic<uint64_t> tail;     // position of the next event to be posted
+        std::atomic<uint64_t>             dropped;
+        std::atomic<uint32_t>             peak;
+
+        alignas(64) std::atomic<uint64_t> head;     // position of the next event to be handled
+        std::atomic<uint64_t>             done;     // events whose handlers have returned
+        std::atomic<bool>                 sleeping; // true while the worker waits for an event
+
+        std::mutex                        lock;     // guards the wait for an event, and the wake
+        std::condition_variable           posted;
+    };
+
+    /*
+     * Calls the handler of 'event' of 'gear'.
+     */
+    static void handle(Base_Gear* gear, uint8_t event);
+
+    void worker(unsigned self);
+
+    std::vector<std::unique_ptr<Ring>> rings;       // one per worker
+    std::vector<std::thread>           threads;
+    std::atomic<bool>                  stopping;
+};
+
+#endif // _WELLWOOD_HANDLER_POOL_H_ //
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#include "timing_wheel.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Timing_Wheel::Timing_Wheel(uint64_t now)
+: now(now)
+{ }
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Timing_Wheel::reset(uint64_t now)
+{
+    for (int level = 0; level < Levels; level++)
+    {
+        for (int slot = 0; slot < Slots; slot++)
+        {
+            slots[level][slot].clear();
+        }
+    }
+    this->now = now;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Timing_Wheel::insert(uint32_t item, uint64_t due)
+{
+    Entry entry;
+    entry.due = (due > now) ? due : now + 1;
+    entry.item = item;
+    place(entry);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Timing_Wheel::place(const Entry& entry)
+{
+    // the entry goes on the level of the highest digit in which its due tick differs from now
+    uint64_t diff = entry.due ^ now;
+    int level = 0;
+    while (level + 1 < Levels && (diff >> ((level + 1) * Slot_Bits)) != 0)
+    {
+        level++;
+    }
+    slots[level][(entry.due >> (level * Slot_Bits)) & (Slots - 1)].push_back(entry);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Timing_Wheel::tick(std::vector<uint32_t>& due)
+{
+    now++;
+
+    // when the clock enters a new slot on a level, the entries in it move down. the highest level
+    // entered moves first, so its entries can cascade all the way down to the first level.
+    int level = 0;
+    while (level + 1 < Levels && (now & ((1ULL << ((level + 1) * Slot_Bits)) - 1)) == 0)
+    {
+        level++;
+    }
+    for (; level > 0; level--)
+    {
+        cascade.swap(slots[level][(now >> (level * Slot_Bits)) & (Slots - 1)]);
+        for (size_t i = 0; i < cascade.size(); i++)
+        {
+            place(cascade[i]);
+        }
+        cascade.clear();
+    }
+
+    std::vector<Entry>& slot = slots[0][now & (Slots - 1)];
+    for (size_t i = 0; i < slot.size(); i++)
+    {
+        due.push_back(slot[i].item);
+    }
+    slot.clear();
+}
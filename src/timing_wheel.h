@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#ifndef _WELLWOOD_TIMING_WHEEL_H_
+#define _WELLWOOD_TIMING_WHEEL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Timing_Wheel is a hierarchical timing wheel, holding items that are due on a tick of a 64-bit
+ * clock. Each level of the wheel has 64 slots, and each slot spans 64 times as many ticks as a
+ * slot on the level below it. An item is placed on the lowest level that reaches its due tick,
+ * and moves down a level each time the clock enters its slot, so inserting an item and ticking
+ * the clock take constant time, however far in the future items are due.
+ */
+class Timing_Wheel
+{
+public:
+
+    explicit Timing_Wheel(uint64_t now = 0);
+
+    /*
+     * Removes all items and sets the clock to 'now'.
+     */
+    void reset(uint64_t now);
+
+    /*
+     * Returns the current tick of the clock.
+     */
+    uint64_t get_now() const { return now; }
+
+    /*
+     * Inserts 'item' to be due on tick 'due'. An item due on or before the current tick will be
+     * due on the next tick.
+     */
+    void insert(uint32_t item, uint64_t due);
+
+    /*
+     * Advances the clock by one tick, and appends the items due on it to 'due', in no particular
+     * order.
+     */
+    void tick(std::vector<uint32_t>& due);
+
+private:
+
+    Timing_Wheel(const Timing_Wheel& other) = delete;
+    Timing_Wheel& operator=(const Timing_Wheel&) = delete;
+
+    static const int Slot_Bits = 6;
+    static const int Slots = 1 << Slot_Bits;
+    static const int Levels = (64 + Slot_Bits - 1) / Slot_Bits;
+
+    struct Entry
+    {
+        uint64_t due;
+        uint32_t item;
+    };
+
+    /*
+     * Places an entry due no earlier than the current tick in its slot.
+     */
+    void place(const Entry& entry);
+
+    std::vector<Entry> slots[Levels][Slots];
+    std::vector<Entry> cascade;     // entries moving down from a slot, reused to avoid allocation
+    uint64_t now;
+};
+
+#endif // _WELLWOOD_TIMING_WHEEL_H_ //
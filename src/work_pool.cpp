@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#include "work_pool.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Work_Pool::Work_Pool(unsigned workers)
+: batch(0)
+, stopping(false)
+, job(nullptr)
+, context(nullptr)
+, remaining(0)
+{
+    for (unsigned i = 0; i <= workers; i++)
+    {
+        queues.emplace_back(new Queue());
+    }
+    for (unsigned i = 1; i <= workers; i++)
+    {
+        threads.emplace_back(&Work_Pool::worker, this, i);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+Work_Pool::~Work_Pool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    started.notify_all();
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Work_Pool::run(uint32_t tasks, Job job, void* context)
+{
+    if (tasks == 0)
+    {
+        return;
+    }
+
+    this->job = job;
+    this->context = context;
+    remaining.store(tasks, std::memory_order_relaxed);
+
+    // each thread is dealt a contiguous block of tasks, so neighbouring tasks, which tend to share
+    // cache lines, run on the same thread unless they are stolen
+    const unsigned n = size();
+    for (unsigned i = 0; i < n; i++)
+    {
+        uint32_t first = (uint32_t)((uint64_t)tasks * i / n);
+        uint32_t last = (uint32_t)((uint64_t)tasks * (i + 1) / n);
+
+        std::lock_guard<std::mutex> guard(queues[i]->lock);
+        for (uint32_t task = first; task < last; task++)
+        {
+            queues[i]->tasks.push_back(task);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        batch++;
+    }
+    started.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [this] { return remaining.load(std::memory_order_acquire) == 0; });
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Work_Pool::work(unsigned self)
+{
+    uint32_t task;
+    while (take(self, task))
+    {
+        job(context, task);
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            finished.notify_all();
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+bool Work_Pool::take(unsigned self, uint32_t& task)
+{
+    {
+        Queue& own = *queues[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    const unsigned n = size();
+    for (unsigned i = 1; i < n; i++)
+    {
+        Queue& victim = *queues[(self + i) % n];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - //
+
+void Work_Pool::worker(unsigned self)
+{
+    uint64_t seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            started.wait(guard, [this, seen] { return stopping || batch != seen; });
+            if (stopping)
+            {
+                return;
+            }
+            seen = batch;
+        }
+        work(self);
+    }
+}
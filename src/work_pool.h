@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2017-2020 Kevin Wellwood
+ * All rights reserved.
+ *
+ * This source code is distributed under the Modified BSD License. For terms and
+ * conditions, see license.txt.
+ */
+
+#ifndef _WELLWOOD_WORK_POOL_H_
+#define _WELLWOOD_WORK_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Work_Pool runs a batch of independent tasks on a set of worker threads and the thread that
+ * submits them. The tasks of a batch are dealt out in order to a queue per thread. Each thread
+ * takes tasks in order from the front of its own queue, and when it runs out, steals them from
+ * the back of the queues of the others, so a thread that draws short tasks keeps busy while
+ * others work through long ones. run() returns once every task of the batch has finished, so it
+ * is also a barrier.
+ */
+class Work_Pool
+{
+public:
+
+    typedef void (*Job)(void* context, uint32_t task);
+
+    /*
+     * Starts 'workers' worker threads. The thread calling run() works alongside them, so a pool
+     * with no workers runs every task on the calling thread.
+     */
+    explicit Work_Pool(unsigned workers);
+
+    ~Work_Pool();
+
+    /*
+     * Calls job(context, task) for every task from 0 to 'tasks' - 1, and returns when all have
+     * returned. Tasks may run concurrently and in any order. Only one thread may call run() at a
+     * time, and a job may not call run().
+     */
+    void run(uint32_t tasks, Job job, void* context);
+
+    /*
+     * Returns the number of threads that run tasks, including the calling thread.
+     */
+    unsigned size() const { return (unsigned)queues.size(); }
+
+private:
+
+    Work_Pool(const Work_Pool& other) = delete;
+    Work_Pool& operator=(const Work_Pool&) = delete;
+
+    struct Queue
+    {
+        std::mutex           lock;
+        std::deque<uint32_t> tasks;
+    };
+
+    /*
+     * Runs tasks of the current batch as thread 'self', until no queue has any left.
+     */
+    void work(unsigned self);
+
+    /*
+     * Takes a task for thread 'self', from its own queue or another's. Returns false if there are
+     * none left.
+     */
+    bool take(unsigned self, uint32_t& task);
+
+    void worker(unsigned self);
+
+    std::vector<std::unique_ptr<Queue>> queues;     // one per thread, the calling thread's first
+    std::vector<std::thread>            threads;
+
+    std::mutex              lock;           // guards batch and stopping
+    std::condition_variable started;        // signalled when a batch is submitted or on stopping
+    std::condition_variable finished;       // signalled when the last task of a batch finishes
+    uint64_t                batch;          // number of batches submitted
+    bool                    stopping;
+
+    Job                     job;            // job of the current batch
+    void*                   context;
+    std::atomic<uint32_t>   remaining;      // tasks of the current batch not yet finished
+};
+
+#endif // _WELLWOOD_WORK_POOL_H_ //